@@ -22,7 +22,12 @@
 
 #include "allele.hpp"
 
+#include <cctype>
+#include <charconv>
 #include <cstddef>
+#include <limits>
+#include <optional>
+#include <utility>
 #include <variant>
 
 #include <bio/io/exception.hpp>
@@ -33,12 +38,64 @@
 
 #include <sharg/all.hpp>
 
-#include "../generator.hpp"
+#include "../batch.hpp"
+#include "../carriers.hpp"
+#include "../columnar.hpp"
+#include "../decovar.hpp"
+#include "../memory_budget.hpp"
 #include "../misc.hpp"
-#include "localise.hpp"
-#include "remove.hpp"
+#include "../read_ahead.hpp"
+#include "../thread_pool.hpp"
+#include "../write_behind.hpp"
 #include "split.hpp"
 
+std::vector<size_t> parse_length_thresholds(std::string_view const arg)
+{
+    std::vector<size_t> thresholds;
+
+    for (auto && subrange : arg | std::views::split(','))
+    {
+        std::string_view const str{subrange.begin(), subrange.end()};
+        size_t                 threshold = 0;
+        auto [ptr, ec]                   = std::from_chars(str.data(), str.data() + str.size(), threshold);
+
+        if (str.empty() || ec != std::errc{} || ptr != str.data() + str.size() || threshold > 100'000ul)
+            throw sharg::validation_error{"Length thresholds must be numbers between 0 and 100000, separated by ','."};
+
+        if (threshold > 0) // 0 → no splitting
+            thresholds.push_back(threshold);
+    }
+
+    std::ranges::sort(thresholds);
+    thresholds.erase(std::ranges::unique(thresholds).begin(), thresholds.end());
+
+    if (thresholds.size() >= _split::max_classes)
+    {
+        throw sharg::validation_error{
+          fmt::format("At most {} length thresholds may be given.", _split::max_classes - 1)};
+    }
+
+    return thresholds;
+}
+
+std::vector<std::string> parse_field_list(std::string_view const arg)
+{
+    std::vector<std::string> fields;
+
+    for (auto && subrange : arg | std::views::split(','))
+    {
+        std::string_view const str{subrange.begin(), subrange.end()};
+
+        if (str.empty() || !std::ranges::all_of(str, [](unsigned char const c) { return std::isalnum(c) || c == '_'; }))
+            throw sharg::validation_error{"Field lists must contain FORMAT field IDs separated by ','."};
+
+        if (std::ranges::find(fields, str) == fields.end())
+            fields.emplace_back(str);
+    }
+
+    return fields;
+}
+
 program_options parse_options(sharg::parser & parser)
 {
     program_options opts;
@@ -48,15 +105,18 @@ program_options parse_options(sharg::parser & parser)
       sharg::config{.short_id = 'v', .long_id = "verbose", .description = "Print diagnostics to stderr."});
 
     parser.add_subsection("Input / Output:");
-    parser.add_positional_option(opts.input_file,
-                                 sharg::config{.description = "Path to input file or '-' for stdin.",
+    parser.add_positional_option(opts.input_files,
+                                 sharg::config{.description = "Paths to input files or '-' for stdin. Several files "
+                                                              "are processed at the same time, sharing the threads.",
                                                .required    = true,
                                                .validator   = input_file_or_stdin_validator{{"vcf", "vcf.gz", "bcf"}}});
     parser.add_option(opts.output_file,
                       sharg::config{
                         .short_id    = 'o',
                         .long_id     = "output",
-                        .description = "Path to output file or '-' for stdout.",
+                        .description = "Path to output file or '-' for stdout. With several input files, the path "
+                                       "must contain {} which is replaced by the input file's name without "
+                                       "extension, e.g. out/{}.bcf; as must the paths of additional outputs.",
                         .validator   = output_file_or_stdout_validator{sharg::output_file_open_options::create_new,
                                                                        {"vcf", "vcf.gz", "bcf"}}
     });
@@ -72,6 +132,25 @@ program_options parse_options(sharg::parser & parser)
                         .validator   = sharg::value_list_validator{'a', 'b', 'u', 'z', 'v'}
     });
 
+    parser.add_option(opts.columnar_prefix,
+                      sharg::config{
+                        .long_id     = "columnar",
+                        .description = "Additionally write the FORMAT fields selected by --columnar-fields as raw "
+                                       "integer arrays to PREFIX.FIELD.values and PREFIX.FIELD.offsets, e.g. for "
+                                       "memory-mapping with numpy. PREFIX.schema.tsv describes the layout."});
+
+    std::string columnar_fields_arg = "PL,LPL,AD,LAD,LAA";
+    parser.add_option(columnar_fields_arg,
+                      sharg::config{.long_id     = "columnar-fields",
+                                    .description = "Comma-separated list of integer FORMAT fields for --columnar."});
+
+    parser.add_option(opts.carrier_index,
+                      sharg::config{
+                        .long_id     = "carrier-index",
+                        .description = "Additionally write a run-length encoded bitmap of which samples carry which "
+                                       "ALT allele in their called genotype (GT, or else the smallest LPL or PL) to "
+                                       "this file, and the offset of every record in that file to FILE.idx."});
+
     parser.add_subsection("Remove rare alleles:");
     parser.add_line(
       "Allows removing certain alleles from multi-allelic records. All fields with A, R or G multiplicity"
@@ -90,13 +169,20 @@ program_options parse_options(sharg::parser & parser)
 
     parser.add_line("Multi-allelic records are split into two or more with some alleles each.", true);
 
-    parser.add_option(opts.split_by_length,
+    std::string split_by_length_arg;
+    parser.add_option(split_by_length_arg,
                       sharg::config{
                         .long_id     = "split-by-length",
-                        .description = "Alleles shorter than this will stay in this record; longer "
-                                       "ones are moved into a separate one. 0 → no splitting.",
-                        .validator   = sharg::arithmetic_range_validator{0ul, 100'000ul}
-    });
+                        .description = "Comma-separated list of up to 15 length thresholds, e.g. 1,50,1000. Alleles "
+                                       "are grouped by the thresholds that they are longer than, and every group is "
+                                       "moved into a separate record. A single threshold T creates one record with "
+                                       "alleles of length <= T and one with the longer ones. 0 → no splitting."});
+
+    parser.add_flag(opts.split_by_class,
+                    sharg::config{.long_id     = "split-by-class",
+                                  .description = "Move substitutions (SNVs/MNVs), indels, symbolic alleles (e.g. "
+                                                 "<DEL>, <*>) and breakends into separate records. Can be combined "
+                                                 "with --split-by-length (at most 3 thresholds)."});
 
     parser.add_subsection("Allele localisation:");
 
@@ -113,10 +199,18 @@ program_options parse_options(sharg::parser & parser)
                         .short_id    = 'L',
                         .long_id     = "local-alleles",
                         .description = "For multi-allelic records with more than L alleles, transform global alleles "
-                                       "to local alleles. 0 → never transform.",
+                                       "to local alleles. 0 → never transform. In combination with --auto-L, this is "
+                                       "the largest L that is chosen (0 → no limit).",
                         .validator   = sharg::arithmetic_range_validator{0, 127}
     });
 
+    parser.add_flag(opts.auto_local_alleles,
+                    sharg::config{.long_id     = "auto-L",
+                                  .description = "Choose L per record: the smallest L that covers the most likely "
+                                                 "genotype of every sample is used, but only if LAA, LPL and LAD are "
+                                                 "estimated to be smaller than PL and AD. Otherwise the record is not "
+                                                 "transformed."});
+
     parser.add_option(opts.keep_global_fields,
                       sharg::config{.long_id     = "keep-global-fields",
                                     .description = "If set, PL and AD fields are kept in addition to LPL and LAD."});
@@ -128,28 +222,85 @@ program_options parse_options(sharg::parser & parser)
                                                    "file size and provides no advantage other than enabling same "
                                                    "FORMATs for all records."});
 
+    parser.add_subsection("Genotype likelihoods:");
+
+    parser.add_option(opts.pl_cap,
+                      sharg::config{
+                        .long_id     = "pl-cap",
+                        .description = "Cap PL values at this value when PL or LPL fields are rewritten. Values of "
+                                       "127 or less allow storing the fields as 8bit integers. 0 → no capping.",
+                        .validator   = sharg::arithmetic_range_validator{0, 32767}
+    });
+
     parser.add_subsection("Performance:");
     parser.add_option(opts.threads,
                       sharg::config{
                         .short_id    = '@',
                         .long_id     = "threads",
-                        .description = "Maximum number of threads to use.",
-                        .validator   = sharg::arithmetic_range_validator{2u, std::thread::hardware_concurrency() * 2}
+                        .description = "Maximum number of threads to use for all input files together. 0 → all CPUs "
+                                       "available to the process, i.e. respecting the CPU affinity mask and cgroup "
+                                       "CPU quota. The default is the number of available CPUs, but at most 8.",
+                        .validator   = sharg::arithmetic_range_validator{0ul, std::max<size_t>(2, available_cpus() * 2)}
     });
 
+    parser.add_option(opts.max_memory,
+                      sharg::config{
+                        .long_id     = "max-memory",
+                        .description = "Approximate limit in MiB for the records held between reading and writing. "
+                                       "Reading pauses while it is exceeded. Buffers of the (de)compression threads "
+                                       "are not included. 0 → no limit."});
+
+    std::string cpu_affinity_arg;
+    parser.add_option(cpu_affinity_arg,
+                      sharg::config{
+                        .long_id     = "cpu-affinity",
+                        .description = "Pin the thread groups to CPUs, given as READER:TRANSFORM:WRITER with each "
+                                       "group a CPU list like 0-3,8. Reader: decompression and decoding; transform: "
+                                       "main thread and worker pool; writer: encoding and compression. An empty list "
+                                       "leaves a group unpinned. Buffers are allocated by the threads that fill them, "
+                                       "so pinning the groups to one socket keeps their memory on its NUMA node."});
+
     parser.parse();
+
+    opts.threads  = resolve_thread_count(opts.threads);
+    opts.affinity = parse_cpu_affinity(cpu_affinity_arg);
+    opts.split_by_length = parse_length_thresholds(split_by_length_arg);
+    opts.columnar_fields = parse_field_list(columnar_fields_arg);
+
+    std::vector<std::string> columnar_files{".schema.tsv"};
+    for (std::string const & field : opts.columnar_fields)
+    {
+        columnar_files.push_back("." + field + ".values");
+        columnar_files.push_back("." + field + ".offsets");
+    }
+    validate_output_templates(opts.input_files,
+                              {
+                                {.path = opts.output_file, .extensions = {"vcf", "vcf.gz", "bcf"}},
+                                {.path = opts.columnar_prefix, .suffixes = columnar_files},
+                                {.path = opts.carrier_index, .suffixes = {"", ".idx"}}
+    });
+
+    if (_split::n_classes(opts) > _split::max_classes)
+        throw sharg::validation_error{"Too many length thresholds in combination with --split-by-class."};
+
     return opts;
 }
 
-void allele(sharg::parser & parser)
+/* threads of a file that may use the given number of threads */
+file_threads_t io_threads(size_t const threads)
 {
-    program_options opts = parse_options(parser);
+    bool const encode_thread = threads >= 4;                // otherwise records are encoded on the main thread
+    return divide_file_threads(threads, 2 + encode_thread); // main thread, decoding and encoding
+}
 
-    size_t threads        = opts.threads - 1; // subtract one for the main thread
-    size_t reader_threads = threads / 3;
-    size_t writer_threads = threads - reader_threads;
+/* transforms opts.input_file; the pool is shared with the files that are processed at the same time */
+void allele_file(program_options const & opts, size_t const threads, decovar::thread_pool & pool)
+{
+    bool const encode_thread                                  = threads >= 4;
+    auto const [reader_threads, writer_threads, pool_threads] = io_threads(threads);
 
     /* setup reader */
+    pin_thread_group(opts.affinity.reader);
     bio::io::var::reader_options reader_opts{.record = record_t{},
                                              .stream_options =
                                                bio::io::transparent_istream_options{.threads = reader_threads + 1}};
@@ -157,127 +308,103 @@ void allele(sharg::parser & parser)
                                                            : bio::io::var::reader{opts.input_file, reader_opts};
 
     /* setup writer */
+    pin_thread_group(opts.affinity.writer);
     bio::io::var::writer writer = create_writer(opts.output_file, opts.output_file_type, writer_threads);
 
-    /* ========= setup header =========== */
-    if (opts.local_alleles > 0ul) // we need to create a new header
-    {
-        bio::io::var::header new_hdr = reader.header(); // create copy
-
-        if (!new_hdr.string_to_format_pos().contains("LAA"))
-            new_hdr.formats.push_back(bio::io::var::reserved_formats.at("LAA"));
-        if (new_hdr.string_to_format_pos().contains("AD") && !new_hdr.string_to_format_pos().contains("LAD"))
-            new_hdr.formats.push_back(bio::io::var::reserved_formats.at("LAD"));
-        // if (new_hdr.string_to_format_pos().contains("GT") && !new_hdr.string_to_format_pos().contains("LGT"))
-        //     new_hdr.formats.push_back(bio::io::var::reserved_formats.at("LGT"));
-        if (new_hdr.string_to_format_pos().contains("PL") && !new_hdr.string_to_format_pos().contains("LPL"))
-            new_hdr.formats.push_back(bio::io::var::reserved_formats.at("LPL"));
-
-        new_hdr.add_missing();
-        writer.set_header(std::move(new_hdr));
-    }
-    else // just use existing header as-is
-    {
-        writer.set_header(reader.header());
-    }
+    /* the transforms are divided between the pool's threads */
+    decovar::allele_transform transform{opts, reader.header(), pool};
 
-    bio::io::var::header const & hdr = writer.header();
+    writer.set_header(transform.header());
+    bio::io::var::header const & hdr       = writer.header();
+    size_t const                 n_samples = hdr.column_labels.size() > 9 ? hdr.column_labels.size() - 9 : 0;
 
-    /* caches */
-    size_t             record_no = -1; // always refers to #record in input even if more records are created
-    _remove::cache_t   filter_vectors;
-    _localise::cache_t localise_cache;
+    size_t        record_no = -1; // always refers to #record in input even if more records are created
+    memory_budget budget{opts.max_memory << 20};
+    record_batch  batch{n_samples, budget};
 
-    /* ========= define steps =========== */
+    std::optional<columnar_writer> columnar;
+    if (!opts.columnar_prefix.empty())
+        columnar.emplace(opts.columnar_prefix, opts.columnar_fields, hdr);
 
-    /* pre */
-    auto pre_fn = [&](record_t & record) -> record_t &
-    {
-        ++record_no;
-        return record;
-    };
-    auto pre_view = std::views::transform(pre_fn);
+    std::optional<carrier_index_writer> carrier_index;
+    if (!opts.carrier_index.empty())
+        carrier_index.emplace(opts.carrier_index);
 
-    /* remove rare alleles */
-    auto remove_rare_alleles_fn = [&](record_t & record) -> std::generator<record_t &>
+    /* write; the record is tagged with the number of the input record it was created from */
+    auto consume_fn = [&](record_t & record, size_t const input_no)
     {
-        if (record.alt.size() > 1ul && opts.rare_af_threshold != 0.0)
-        {
-            log(opts, "↓ record no {} allelle-removal begin.\n", record_no);
-            bool all_alleles_removed = _remove::remove_rare_alleles(record, record_no, hdr, opts, filter_vectors);
-            log(opts, "↑ record no {} allelle-removal end.\n", record_no);
-            if (all_alleles_removed)
-                co_return;
-        }
-
-        co_yield record;
+        writer.push_back(record);
+
+        if (columnar)
+            columnar->push_back(record, input_no);
+        if (carrier_index)
+            carrier_index->push_back(record, input_no);
     };
-    auto remove_rare_alleles_view = std::views::transform(remove_rare_alleles_fn) | views_cojoin;
+    pin_thread_group(opts.affinity.writer);
+    write_behind<size_t, decltype(consume_fn)> behind{consume_fn, budget, encode_thread};
+    std::vector<size_t>                        tags;
 
-    /* split */
-    auto split_fn = [&](record_t & record) -> std::generator<record_t &>
+    /* batch: transform, then hand over for writing in order; the transform salvages the records received back */
+    auto process_batch = [&]()
     {
-        if (opts.split_by_length > 0 && _split::needs_splitting(record, opts))
-        {
-            log(opts, "↓ record no {} splitting-by-length begin.\n", record_no);
-
-            /* create second record */
-            record_t record0 = record;
-            if (record0.id != ".")
-            {
-                record0.id += "_split1";
-                record.id += "_split2";
-            }
+        std::span<record_t> const records = transform.process(batch.records(), batch.record_nos());
 
-            // short alleles (remove gt)
-            _split::remove_alleles(record0, record_no, _split::gt, hdr, opts, filter_vectors);
+        tags.assign(transform.record_nos().begin(), transform.record_nos().end());
+        behind.push(records, tags, batch.bytes());
 
-            // long alleles (remove leq)
-            _split::remove_alleles(record, record_no, _split::leq, hdr, opts, filter_vectors);
+        batch.clear();
+    };
 
-            log(opts, "↑ record no {} splitting-by-length end.\n", record_no);
+    /* ========= iterate =========== */
+    pin_thread_group(opts.affinity.reader);
+    read_ahead ahead{reader, budget};
+    pin_thread_group(opts.affinity.transform);
 
-            co_yield record0;
-        }
+    for (record_t & record : ahead.records())
+    {
+        batch.push_back(record, ++record_no);
+        if (batch.full())
+            process_batch();
+    }
 
-        co_yield record;
-    };
-    auto split_view = std::views::transform(split_fn) | views_cojoin;
+    if (!batch.empty())
+        process_batch();
 
-    /* localise */
-    auto localise_fn = [&](record_t & record) -> record_t &
-    {
-        if (opts.local_alleles != 0)
-        {
-            if (record.alt.size() > opts.local_alleles)
-            {
-                log(opts, "↓ record no {} allelle-localisation begin.\n", record_no);
-                _localise::localise_alleles(record, record_no, hdr, opts, localise_cache);
-                log(opts, "↑ record no {} allelle-localisation end.\n", record_no);
-            }
-            else if (opts.transform_all)
-            {
-                log(opts, "↓ record no {} allelle-pseudo-localisation begin.\n", record_no);
-                _localise::pseudo_localise_alleles(record, record_no, hdr, opts, localise_cache);
-                log(opts, "↑ record no {} allelle-pseudo-localisation end.\n", record_no);
-            }
-        }
-
-        return record;
-    };
-    auto localise_view = std::views::transform(localise_fn);
+    behind.finish();
 
-    /* ========= create pipeline =========== */
-    auto pipeline = reader | pre_view | remove_rare_alleles_view | split_view | localise_view;
+    if (columnar)
+        columnar->finish();
+}
 
-    /* ========= iterate =========== */
-    for (record_t & record : pipeline)
-    {
-        /* finally write the (modified) record */
-        writer.push_back(record);
+void allele(sharg::parser & parser)
+{
+    program_options opts = parse_options(parser);
 
-        /* salvage memory */
-        if (opts.local_alleles != 0 && ((record.alt.size() > opts.local_alleles) || opts.transform_all))
-            _localise::salvage_cache(record, localise_cache);
-    }
+    /* Several files are processed at the same time, each with its own share of the threads for reading and writing.
+     * The transform threads are pooled, so that files with expensive records can use the share of the others. */
+    size_t const n_files      = opts.input_files.size();
+    size_t const n_concurrent = concurrent_files(n_files, opts.threads);
+    size_t const file_threads = std::max<size_t>(2, opts.threads / n_concurrent);
+
+    pin_thread_group(opts.affinity.transform);
+    decovar::thread_pool pool{n_concurrent * io_threads(file_threads).pool};
+
+    for_each_file(n_files,
+                  n_concurrent,
+                  [&](size_t const i)
+                  {
+                      program_options file_opts = opts;
+                      file_opts.input_file      = opts.input_files[i];
+                      file_opts.output_file     = expand_output_template(opts.output_file, file_opts.input_file);
+                      file_opts.columnar_prefix = expand_output_template(opts.columnar_prefix, file_opts.input_file);
+                      file_opts.carrier_index   = expand_output_template(opts.carrier_index, file_opts.input_file);
+                      if (opts.max_memory > 0)
+                          file_opts.max_memory = std::max<size_t>(1, opts.max_memory / n_concurrent);
+
+                      log(opts,
+                          "Processing {} → {}.\n",
+                          file_opts.input_file.string(),
+                          file_opts.output_file.string());
+                      allele_file(file_opts, file_threads, pool);
+                  });
 }
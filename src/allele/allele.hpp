@@ -21,28 +21,34 @@
 // SOFTWARE.
 
 #include <cstddef>
-#include <thread>
+#include <filesystem>
+#include <string>
 #include <variant>
+#include <vector>
 
 #include <sharg/all.hpp>
 
+#include "../cpus.hpp"
+#include "../decovar.hpp"
+
 #pragma once
 
 void allele(sharg::parser & sub_parser);
 
-struct program_options
+struct program_options : decovar::allele_options
 {
-    std::filesystem::path input_file;
-    std::filesystem::path output_file      = "-";
-    char                  output_file_type = 'a';
-
-    float  rare_af_threshold  = 0ul;
-    size_t local_alleles      = 0ul;
-    bool   keep_global_fields = false;
-    bool   transform_all      = false;
-    size_t split_by_length    = 0ul;
-
-    size_t threads = std::max<size_t>(2, std::min<size_t>(8, std::thread::hardware_concurrency()));
+    std::vector<std::filesystem::path> input_files;
+    std::filesystem::path              input_file;             // the one of input_files being processed
+    std::filesystem::path              output_file      = "-"; // "{}" is replaced by the input's name
+    char                               output_file_type = 'a';
+
+    std::filesystem::path    columnar_prefix;
+    std::vector<std::string> columnar_fields = {"PL", "LPL", "AD", "LAD", "LAA"};
+    std::filesystem::path    carrier_index;
+
+    size_t       threads    = std::max<size_t>(2, std::min<size_t>(8, available_cpus()));
+    size_t       max_memory = 0ul; // MiB; 0 → no limit
+    cpu_affinity affinity;         // empty → threads are not pinned
 
     bool verbose = false;
 };
@@ -22,15 +22,20 @@
 
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <cstdint>
+#include <memory>
+#include <mutex>
 #include <ranges>
 
 #include <bio/io/var/record.hpp>
 #include <bio/ranges/container/concatenated_sequences.hpp>
 #include <bio/ranges/views/zip.hpp>
 
+#include "../decovar.hpp"
 #include "../misc.hpp"
-#include "allele.hpp"
+#include "../sparse_pl.hpp"
 
 namespace _localise
 {
@@ -38,8 +43,10 @@ namespace _localise
 struct cache_t
 {
     // vector of size L that contains the indexes of the retained alleles for each sample
-    bio::ranges::concatenated_sequences<std::vector<int32_t /*TODO?*/>> laa;
+    bio::ranges::concatenated_sequences<std::vector<int32_t>> laa;
 
+
+    // LPL buffers
     bio::ranges::concatenated_sequences<std::vector<int8_t>>  vec8;
     bio::ranges::concatenated_sequences<std::vector<int16_t>> vec16;
     bio::ranges::concatenated_sequences<std::vector<int32_t>> vec32;
@@ -55,8 +62,153 @@ struct cache_t
             return vec32;
     }
 
+    // LAD buffers
+    bio::ranges::concatenated_sequences<std::vector<int8_t>>  lad8;
+    bio::ranges::concatenated_sequences<std::vector<int16_t>> lad16;
+    bio::ranges::concatenated_sequences<std::vector<int32_t>> lad32;
+
+    template <std::signed_integral int_t>
+    auto & get_lad_buf()
+    {
+        if constexpr (BIOCPP_IS_SAME(int_t, int8_t))
+            return lad8;
+        else if constexpr (BIOCPP_IS_SAME(int_t, int16_t))
+            return lad16;
+        else
+            return lad32;
+    }
+
+    template <std::signed_integral int_t>
+    auto & get_buf(std::string_view const id)
+    {
+        return id == "LAD" ? get_lad_buf<int_t>() : get_buf<int_t>();
+    }
+
+    // Buffers for LAA, LAD and LPL fields that records take over. salvage_cache returns the fields of earlier records,
+    // so that every record of a batch finds a buffer. Only as many buffers are kept as were taken, so that memory
+    // which records do not give back (e.g. renamed PL fields) is not hoarded.
+    template <std::signed_integral int_t>
+    struct spare_t
+    {
+        std::vector<bio::ranges::concatenated_sequences<std::vector<int_t>>> buffers;
+        size_t                                                               n_taken = 0; // and not given back
+
+        // a spare buffer, or an empty one
+        bio::ranges::concatenated_sequences<std::vector<int_t>> take()
+        {
+            ++n_taken;
+            if (buffers.empty())
+                return {};
+
+            auto ret = std::move(buffers.back());
+            buffers.pop_back();
+            return ret;
+        }
+
+        void give(bio::ranges::concatenated_sequences<std::vector<int_t>> & buffer)
+        {
+            if (n_taken > 0 && buffer.raw_data().first.capacity() > 0)
+            {
+                --n_taken;
+                buffers.push_back(std::move(buffer));
+            }
+        }
+    };
+
+    struct spares_t
+    {
+        spare_t<int8_t>  spare8;
+        spare_t<int16_t> spare16;
+        spare_t<int32_t> spare32;
+
+        template <std::signed_integral int_t>
+        auto & get()
+        {
+            if constexpr (BIOCPP_IS_SAME(int_t, int8_t))
+                return spare8;
+            else if constexpr (BIOCPP_IS_SAME(int_t, int16_t))
+                return spare16;
+            else
+                return spare32;
+        }
+    };
+
+    // constant LAA fields (1, 2, …, n_alts for every sample) of pseudo-localised records, indexed by n_alts; the
+    // buffers keep their values, so that salvaged fields need not be rebuilt. A field holds n_samples × n_alts
+    // values and is kept once built, so only the small n_alts of most records are cached; records with more alleles
+    // build their field in an LAA spare buffer.
+    static constexpr size_t pseudo_laa_max_alts = 7;
+
+    // The spare buffers are shared by the caches that localise the parts of a batch: a record may be salvaged into
+    // another cache than the one that lent its buffers, and the counts of taken buffers must still add up.
+    struct spare_pool_t
+    {
+        spares_t                                             laa_spares;
+        spares_t                                             lad_spares;
+        spares_t                                             lpl_spares;
+        std::array<spare_t<int8_t>, pseudo_laa_max_alts + 1> pseudo_laa;
+        std::mutex                                           mtx;
+
+        spares_t & get_spares(std::string_view const id)
+        {
+            return id == "LAA" ? laa_spares : id == "LAD" ? lad_spares : lpl_spares;
+        }
+    };
+
+    std::shared_ptr<spare_pool_t> spares = std::make_shared<spare_pool_t>();
+
+    template <std::signed_integral int_t>
+    bio::ranges::concatenated_sequences<std::vector<int_t>> take_spare(std::string_view const id)
+    {
+        std::lock_guard lock{spares->mtx};
+        return spares->get_spares(id).template get<int_t>().take();
+    }
+
+    // gives the buffer back if one of its kind was taken; returns whether it was
+    template <std::signed_integral int_t>
+    bool give_spare(std::string_view const id, bio::ranges::concatenated_sequences<std::vector<int_t>> & buffer)
+    {
+        std::lock_guard lock{spares->mtx};
+        auto &          spare = spares->get_spares(id).template get<int_t>();
+        if (spare.n_taken == 0)
+            return false;
+        spare.give(buffer);
+        return true;
+    }
+
+    bio::ranges::concatenated_sequences<std::vector<int8_t>> take_pseudo_laa(size_t const n_alts)
+    {
+        std::lock_guard lock{spares->mtx};
+        return spares->pseudo_laa[n_alts].take();
+    }
+
+    bool give_pseudo_laa(size_t const n_alts, bio::ranges::concatenated_sequences<std::vector<int8_t>> & laa)
+    {
+        std::lock_guard lock{spares->mtx};
+        if (spares->pseudo_laa[n_alts].n_taken == 0)
+            return false;
+        spares->pseudo_laa[n_alts].give(laa);
+        return true;
+    }
+
+    // the buffer in which LAD or LPL values are computed; refilled once a record has taken it over
+    template <std::signed_integral int_t>
+    auto & get_work_buf(std::string_view const id)
+    {
+        auto & buffer = get_buf<int_t>(id);
+        if (buffer.raw_data().first.capacity() == 0)
+            buffer = take_spare<int_t>(id);
+        return buffer;
+    }
+
     std::vector<std::pair<double, size_t>> probs_buf;
 
+    // capped PLs of records with many alleles
+    sparse_PLs sparse;
+
+    // local genotypes for values of L that have no compile-time table
+    std::vector<std::pair<uint8_t, uint8_t>> local_genotypes_buf;
+
     std::vector<std::pair<int8_t, size_t>>  pair_buf8;
     std::vector<std::pair<int16_t, size_t>> pair_buf16;
     std::vector<std::pair<int32_t, size_t>> pair_buf32;
@@ -73,23 +225,231 @@ struct cache_t
     }
 };
 
+/* the position of the field in genotypes, or genotypes.size(); records have few FORMAT fields, so this is cheaper
+ * than building an index of the fields for every record */
+inline size_t find_field(record_t::genotypes_t const & genotypes, std::string_view const id)
+{
+    return std::ranges::find(genotypes, id, [](auto const & field) -> std::string_view { return field.id; }) -
+           genotypes.begin();
+}
+
+/* LPL and LAD values are a subset of the PL and AD values, but often fit into a narrower type; narrowed fields are
+ * created in a spare buffer */
+template <std::signed_integral int_t>
+inline void emplace_narrowest(record_t::genotypes_t &                                   genotypes,
+                              std::string_view const                                    id,
+                              bio::ranges::concatenated_sequences<std::vector<int_t>> & buffer,
+                              cache_t &                                                 cache)
+{
+    auto [min, max] = regular_value_range<int_t>(buffer.raw_data().first);
+
+    auto fn = [&]<std::signed_integral out_t>(std::type_identity<out_t>)
+    {
+        if constexpr (sizeof(out_t) < sizeof(int_t))
+        {
+            auto narrow_buffer = cache.take_spare<out_t>(id);
+            concatenated_sequences_convert(buffer, narrow_buffer);
+            genotypes.emplace_back(id, std::move(narrow_buffer));
+        }
+        else
+        {
+            genotypes.emplace_back(id, std::move(buffer));
+        }
+    };
+
+    visit_narrowest_int(min, max, fn);
+}
+
+/* LAA values are in [1, n_alts], so the width can be chosen without looking at the values */
+inline void emplace_laa(record_t::genotypes_t & genotypes, size_t const n_alts, cache_t & cache)
+{
+    auto fn = [&]<std::signed_integral out_t>(std::type_identity<out_t>)
+    {
+        if constexpr (BIOCPP_IS_SAME(out_t, int32_t))
+        {
+            genotypes.emplace_back("LAA", std::move(cache.laa));
+            cache.laa = cache.take_spare<int32_t>("LAA");
+        }
+        else
+        {
+            auto narrow_laa = cache.take_spare<out_t>("LAA");
+            concatenated_sequences_convert(cache.laa, narrow_laa);
+            genotypes.emplace_back("LAA", std::move(narrow_laa));
+        }
+    };
+
+    visit_narrowest_int(1, n_alts, fn);
+}
+
+/* (a, b) of every genotype over REF and L local ALT alleles, in VCF order */
+template <size_t L>
+inline constexpr auto local_genotypes = []()
+{
+    std::array<std::pair<uint8_t, uint8_t>, (L + 1) * (L + 2) / 2> ret{};
+    size_t k = 0;
+    for (size_t b = 0; b <= L; ++b)
+        for (size_t a = 0; a <= b; ++a)
+            ret[k++] = {static_cast<uint8_t>(a), static_cast<uint8_t>(b)};
+    return ret;
+}();
+
+inline void fill_local_genotypes(std::vector<std::pair<uint8_t, uint8_t>> & local_genotypes, size_t const L)
+{
+    local_genotypes.clear();
+    for (size_t b = 0; b <= L; ++b)
+        for (size_t a = 0; a <= b; ++a)
+            local_genotypes.emplace_back(static_cast<uint8_t>(a), static_cast<uint8_t>(b));
+}
+
+/* Gathers LPL from PL for every sample. When called with one of the constexpr local_genotypes tables, the inner
+ * loop has a fixed trip count and is fully unrolled.
+ * Since LAA is sorted, the local genotype (a, b) maps to the global genotype (LAA[a], LAA[b]) whose index is
+ * formula(0, LAA[b]) + LAA[a]; the row offsets formula(0, LAA[b]) are computed once per sample. */
+template <std::signed_integral int_t, typename local_genotypes_t>
+inline void gather_LPLs(bio::ranges::concatenated_sequences<std::vector<int_t>> const &   PLs,
+                        bio::ranges::concatenated_sequences<std::vector<int32_t>> const & laa,
+                        bio::ranges::concatenated_sequences<std::vector<int_t>> &         LPLs,
+                        local_genotypes_t const &                                         local_genotypes,
+                        size_t const                                                      L,
+                        int_t const                                                       cap)
+{
+    std::array<size_t, 128> global; // L is at most 127
+    std::array<size_t, 128> row_offset;
+    global[0]     = 0;
+    row_offset[0] = 0;
+
+    for (size_t i = 0; i < PLs.size(); ++i)
+    {
+        std::span<int32_t const> sample_LAA = laa[i];
+        std::span<int_t const>   sample_PL  = PLs[i];
+        std::span<int_t>         sample_LPL = LPLs[i];
+
+        assert(sample_LAA.size() == L);
+        assert(sample_LPL.size() == local_genotypes.size());
+
+        for (size_t l = 1; l <= L; ++l)
+        {
+            global[l]     = sample_LAA[l - 1];
+            row_offset[l] = bio::io::var::detail::vcf_gt_formula(0, global[l]);
+        }
+
+        for (size_t k = 0; k < local_genotypes.size(); ++k)
+        {
+            auto [a, b] = local_genotypes[k];
+            assert(row_offset[b] + global[a] < sample_PL.size());
+            sample_LPL[k] = std::min(sample_PL[row_offset[b] + global[a]], cap);
+        }
+    }
+}
+
 inline double PL_to_prob(int32_t const PL_val)
 {
     return std::pow(10.0, static_cast<double>(PL_val) / -10.0);
 }
 
+/* the cap below which PL values count for the ranking of alleles; without --pl-cap, all values count */
+template <std::signed_integral int_t>
+inline int32_t ranking_cap(decovar::allele_options const & opts)
+{
+    return opts.pl_cap > 0 ? effective_pl_cap<int_t>(opts.pl_cap) : std::numeric_limits<int32_t>::max();
+}
+
+/* Ranks the alleles of sample j by the summed probability of the genotypes that contain them: afterwards,
+ * probs_buf[1..n_alts] holds the ALT alleles in descending order and ties keep the allele order. Values at or above
+ * the cap add the same to every allele and are skipped (as are reserved values), so that the dense and the sparse
+ * PLs visit the same values in the same order and give the same ranking. */
+template <typename int_t>
+inline void rank_alleles(cache_t const &                                                 cache,
+                         bio::ranges::concatenated_sequences<std::vector<int_t>> const & PLs,
+                         bool const                                                      use_sparse,
+                         size_t const                                                    n_alts,
+                         int32_t const                                                   cap,
+                         size_t const                                                    j,
+                         std::vector<std::pair<double, size_t>> &                        probs_buf)
+{
+    probs_buf.clear();
+    probs_buf.resize(n_alts + 1);
+
+    for (size_t i = 0; i < probs_buf.size(); ++i)
+        probs_buf[i].second = i;
+
+    double const capped_prob = PL_to_prob(cap);
+    auto const   add         = [&](size_t const a, size_t const b, int32_t const value)
+    {
+        if (value < 0 || value >= cap)
+            return;
+
+        double const prob = PL_to_prob(value) - capped_prob;
+        probs_buf[a].first += prob;
+        probs_buf[b].first += prob;
+    };
+
+    if (use_sparse)
+    {
+        for (sparse_PLs::entry_t const & e : cache.sparse[j])
+            add(e.a, e.b, e.value);
+    }
+    else
+    {
+        std::span<int_t const> const sample_PLs = PLs[j];
+        for (size_t b = 0; b <= n_alts; ++b)
+        {
+            for (size_t a = 0; a <= b; ++a)
+            {
+                assert(bio::io::var::detail::vcf_gt_formula(a, b) < sample_PLs.size());
+                add(a, b, convert_int_value<int32_t>(sample_PLs[bio::io::var::detail::vcf_gt_formula(a, b)]));
+            }
+        }
+    }
+
+    // all except the REF allele
+    std::ranges::stable_sort(probs_buf.begin() + 1,
+                             probs_buf.end(),
+                             std::ranges::greater{},
+                             [](auto && pair) { return pair.first; });
+}
+
+/* LAA of the samples in [begin, end); probs_buf is scratch space */
+template <typename int_t>
+inline void determine_laa_samples(cache_t &                                                       cache,
+                                  bio::ranges::concatenated_sequences<std::vector<int_t>> const & PLs,
+                                  bool const                                                      use_sparse,
+                                  size_t const                                                    n_alts,
+                                  int32_t const                                                   cap,
+                                  size_t const                                                    L,
+                                  size_t const                                                    begin,
+                                  size_t const                                                    end,
+                                  std::vector<std::pair<double, size_t>> &                        probs_buf)
+{
+    for (size_t j = begin; j < end; ++j)
+    {
+        rank_alleles(cache, PLs, use_sparse, n_alts, cap, j, probs_buf);
+
+        // now we sort the first L + 1 by their index again
+        std::ranges::sort(probs_buf.begin(),
+                          probs_buf.begin() + L + 1,
+                          std::ranges::less{},
+                          [](auto && pair) { return pair.second; }); // it should be possible to do this nicer
+
+        // 0 (the REF position) is not copied to much dismay; only the next L
+        std::ranges::copy(probs_buf | std::views::elements<1> | bio::views::slice(1, L + 1), cache.laa[j].begin());
+    }
+}
+
+/* With a pool, the samples are divided between its threads (for records that are expensive on their own). */
 template <typename int_t>
 inline void determine_laa(cache_t &                                                       cache,
                           bio::ranges::concatenated_sequences<std::vector<int_t>> const & PLs,
                           record_t const &                                                record,
                           size_t const                                                    record_no,
+                          size_t const                                                    L,
                           header_t const &                                                hdr,
-                          program_options const &                                         opts)
+                          decovar::allele_options const &                                 opts,
+                          decovar::thread_pool * const                                    pool)
 {
-    auto &       laa       = cache.laa;
-    size_t       n_alts    = record.alt.size();
-    size_t       n_samples = hdr.column_labels.size() - 9;
-    size_t const L         = opts.local_alleles;
+    auto & laa       = cache.laa;
+    size_t n_alts    = record.alt.size();
+    size_t n_samples = hdr.column_labels.size() - 9;
 
     if (PLs.concat_size() != n_samples * (bio::io::var::detail::vcf_gt_formula(n_alts, n_alts) + 1))
     {
@@ -99,87 +459,199 @@ inline void determine_laa(cache_t &
           record_no};
     }
 
-    laa.clear();
-    laa.concat_reserve(n_samples * L);
+    concatenated_sequences_create_scaffold(laa, n_samples, L);
+
+    /* with many alleles, almost all PLs are capped and only the others need to be visited */
+    int32_t const cap        = ranking_cap<int_t>(opts);
+    bool const    use_sparse = opts.pl_cap > 0 && PLs.concat_size() / n_samples >= sparse_PL_min_genotypes;
+    if (use_sparse)
+        cache.sparse.assign(PLs, n_alts, cap);
+
+    if (pool != nullptr && pool->size() > 0)
+    {
+        size_t const n_chunks = pool->size() + 1;
+        pool->parallel_for(n_chunks,
+                           [&](size_t const c)
+                           {
+                               std::vector<std::pair<double, size_t>> probs_buf;
+                               determine_laa_samples(cache,
+                                                     PLs,
+                                                     use_sparse,
+                                                     n_alts,
+                                                     cap,
+                                                     L,
+                                                     c * n_samples / n_chunks,
+                                                     (c + 1) * n_samples / n_chunks,
+                                                     probs_buf);
+                           });
+    }
+    else
+    {
+        determine_laa_samples(cache, PLs, use_sparse, n_alts, cap, L, 0, n_samples, cache.probs_buf);
+    }
+
+    assert(laa.concat_size() == n_samples * L);
+
+    log(opts, "Index map: {}\n", laa);
+}
+
+/* Number of local ALT alleles needed to represent every sample's most likely genotype. determine_laa keeps the
+ * top-ranked alleles of a sample, so this is the largest rank of an ALT allele of the most likely genotype (and can
+ * be larger than 2). Stops early once more than max_L alleles are needed. */
+template <std::signed_integral int_t>
+inline size_t needed_local_alleles(cache_t &                                                       cache,
+                                   bio::ranges::concatenated_sequences<std::vector<int_t>> const & PLs,
+                                   size_t const                                                    n_alts,
+                                   int32_t const                                                   cap,
+                                   size_t const                                                    max_L)
+{
+    size_t needed = 0;
 
-    for (std::span<int_t const> const sample_PLs : PLs)
+    for (size_t j = 0; j < PLs.size(); ++j)
     {
-        cache.probs_buf.clear();
-        cache.probs_buf.resize(n_alts + 1);
+        std::span<int_t const> const sample_PLs = PLs[j];
 
-        for (size_t i = 0; i < cache.probs_buf.size(); ++i)
-            cache.probs_buf[i].second = i;
+        int_t  best   = std::numeric_limits<int_t>::max();
+        size_t best_a = 0;
+        size_t best_b = 0;
 
+        size_t k = 0;
         for (size_t b = 0; b <= n_alts; ++b)
         {
-            for (size_t a = 0; a <= b; ++a)
+            for (size_t a = 0; a <= b; ++a, ++k)
             {
-                assert(bio::io::var::detail::vcf_gt_formula(a, b) < sample_PLs.size());
-                double prob = PL_to_prob(sample_PLs[bio::io::var::detail::vcf_gt_formula(a, b)]);
-
-                cache.probs_buf[a].first += prob;
-                cache.probs_buf[b].first += prob;
+                if (sample_PLs[k] >= 0 && sample_PLs[k] < best) // skip missing
+                {
+                    best   = sample_PLs[k];
+                    best_a = a;
+                    best_b = b;
+                }
             }
         }
 
-        // we sort all (except REF allele) by probability
-        std::ranges::sort(cache.probs_buf.begin() + 1,
-                          cache.probs_buf.end(),
-                          std::ranges::greater{},
-                          [](auto && pair) { return pair.first; });
+        if (best_b == 0) // REF/REF (or all missing) needs no ALT allele
+            continue;
 
-        // now we sort the first L + 1 by their index again
-        std::ranges::sort(cache.probs_buf.begin(),
-                          cache.probs_buf.begin() + L + 1,
-                          std::ranges::less{},
-                          [](auto && pair) { return pair.second; }); // it should be possible to do this nicer
+        rank_alleles(cache, PLs, false, n_alts, cap, j, cache.probs_buf);
+        for (size_t rank = 1; rank <= n_alts; ++rank)
+        {
+            size_t const allele = cache.probs_buf[rank].second;
+            if (allele == best_b || allele == best_a)
+                needed = std::max(needed, rank);
+        }
 
-        // 0 (the REF position) is not copied to much dismay; only the next L
-        laa.push_back(cache.probs_buf | std::views::elements<1> | bio::views::slice(1, L + 1));
-        //NOTE, this is likely not the most efficient solution
+        if (needed > max_L)
+            break;
     }
 
-    assert(laa.concat_size() == n_samples * L);
+    return needed;
+}
 
-    log(opts, "Index map: {}\n", laa);
+/* Chooses L for --auto-L: the smallest L that covers the alleles needed by the samples, if storing LAA, LPL and LAD
+ * for that L is estimated to be smaller than storing PL and AD. Returns 0 if the record should not be localised. */
+inline size_t choose_local_alleles(record_t const &                record,
+                                   size_t const                    record_no,
+                                   header_t const &                hdr,
+                                   decovar::allele_options const & opts,
+                                   cache_t &                       cache)
+{
+    size_t const n_alts    = record.alt.size();
+    size_t const n_samples = hdr.column_labels.size() - 9;
+
+    if (n_alts < 2) // n_alts needs to be larger than L
+        return 0;
+
+    size_t const max_L = std::min<size_t>(opts.local_alleles == 0 ? 127 : opts.local_alleles, n_alts - 1);
+
+    size_t PL_width = 0;
+    size_t AD_width = 0;
+    size_t L        = 1;
+
+    for (auto && [id, value] : record.genotypes)
+    {
+        if (id == "PL")
+        {
+            auto visitor = bio::meta::overloaded{
+              [&]<std::signed_integral int_t>(bio::ranges::concatenated_sequences<std::vector<int_t>> const & PLs)
+              {
+                  if (PLs.concat_size() != n_samples * (bio::io::var::detail::vcf_gt_formula(n_alts, n_alts) + 1))
+                  {
+                      throw decovar_error{
+                        "[Record no: {}] Currently, every sample must be diploid and must contain the "
+                        "full number of PL values (e.g. no single '.' placeholder allowed).",
+                        record_no};
+                  }
+
+                  int32_t const cap = ranking_cap<int_t>(opts);
+                  PL_width          = sizeof(int_t);
+                  L                 = std::max(L, needed_local_alleles(cache, PLs, n_alts, cap, max_L));
+              },
+              [record_no](auto const &) {
+                  throw decovar_error{"[Record no: {}] PL-field was in wrong state.", record_no};
+              }};
+
+            std::visit(visitor, value);
+        }
+        else if (id == "AD")
+        {
+            auto visitor = bio::meta::overloaded{
+              [&]<std::signed_integral int_t>(bio::ranges::concatenated_sequences<std::vector<int_t>> const &)
+              { AD_width = sizeof(int_t); },
+              [](auto const &) {}};
+
+            std::visit(visitor, value);
+        }
+    }
+
+    if (PL_width == 0 || L > max_L) // cannot localise without PL; or too many alleles needed
+        return 0;
+
+    size_t const LPL_width = (opts.pl_cap > 0 && opts.pl_cap <= 127) ? 1 : PL_width;
+    size_t const LAA_width = n_alts <= 127 ? 1 : 2;
+
+    size_t const global_bytes =
+      (bio::io::var::detail::vcf_gt_formula(n_alts, n_alts) + 1) * PL_width + (n_alts + 1) * AD_width;
+    size_t const local_bytes =
+      (bio::io::var::detail::vcf_gt_formula(L, L) + 1) * LPL_width + (L + 1) * AD_width + L * LAA_width;
+
+    log(opts, "Estimated bytes per sample: {} global vs {} local (L={}).\n", global_bytes, local_bytes, L);
+
+    return local_bytes < global_bytes ? L : 0;
 }
 
-inline void localise_alleles(record_t &              record,
-                             size_t const            record_no,
-                             header_t const &        hdr,
-                             program_options const & opts,
-                             cache_t &               cache)
+inline void localise_alleles(record_t &                      record,
+                             size_t const                    record_no,
+                             size_t const                    L,
+                             header_t const &                hdr,
+                             decovar::allele_options const & opts,
+                             cache_t &                       cache,
+                             decovar::thread_pool * const    pool = nullptr) // divides the samples between its threads
 {
-#ifndef NDEBUG
-    size_t const n_alts = record.alt.size();
-#endif
+    size_t const n_alts    = record.alt.size();
     size_t const n_samples = hdr.column_labels.size() - 9;
-    size_t const L         = opts.local_alleles;
     assert(n_alts > L);
 
     // TODO the following can be replaced once we have bio::ranges::dictionary
     record.genotypes.reserve(record.genotypes.size() + 3);
-    std::unordered_map<std::string_view, size_t> field_ids;
-    for (size_t i = 0; i < record.genotypes.size(); ++i)
-        field_ids[record.genotypes[i].id] = i;
+    size_t const n_fields = record.genotypes.size();
 
     for (std::string_view id : {"LAA", "LAD", "LGT", "LPL"})
-        if (field_ids.contains(id))
+        if (find_field(record.genotypes, id) < n_fields)
             throw decovar_error{"[Record no: {}] Cannot add {} field, because {} field already present.",
                                 record_no,
                                 id,
                                 id};
 
-    if (auto it = field_ids.find("PL"); it != field_ids.end())
+    if (size_t const pos = find_field(record.genotypes, "PL"); pos < n_fields)
     {
         auto fn = bio::meta::overloaded{
           [&]<std::integral int_t>(bio::ranges::concatenated_sequences<std::vector<int_t>> const & PLs)
-          { determine_laa(cache, PLs, record, record_no, hdr, opts); },
+          { determine_laa(cache, PLs, record, record_no, L, hdr, opts, pool); },
           [record_no](auto const &) {
               throw decovar_error{"[Record no: {}] PL-field was in wrong state.", record_no};
           }};
 
-        std::visit(fn, record.genotypes[it->second].value);
+        std::visit(fn, record.genotypes[pos].value);
     }
     else
     {
@@ -187,27 +659,27 @@ inline void localise_alleles(record_t &              record,
     }
 
     /* LAD */
-    if (auto it = field_ids.find("AD"); it != field_ids.end())
+    if (size_t const pos = find_field(record.genotypes, "AD"); pos < n_fields)
     {
         auto visitor = bio::meta::overloaded{
-          [&]<std::integral int_t>(bio::ranges::concatenated_sequences<std::vector<int_t>> & field_AD)
+          [&]<std::signed_integral int_t>(bio::ranges::concatenated_sequences<std::vector<int_t>> & field_AD)
           {
-              auto & buffer = cache.get_buf<int_t>();
-              buffer.clear();
-              buffer.reserve(n_samples);
-              buffer.concat_reserve(n_samples * (L + 1));
+              auto & buffer = cache.get_work_buf<int_t>("LAD");
+              concatenated_sequences_create_scaffold(buffer, n_samples, L + 1);
 
               assert(field_AD.size() == cache.laa.size());
-              for (auto const && [sample_AD, sample_laa] : bio::views::zip(field_AD, cache.laa))
+              for (size_t i = 0; i < n_samples; ++i)
               {
-                  buffer.push_back();                   // append empty
-                  buffer.push_back_inner(sample_AD[0]); // reference is always appended
-                  for (int32_t i : sample_laa)
-                      buffer.push_back_inner(sample_AD[i]);
+                  std::span<int32_t const> sample_LAA = cache.laa[i];
+                  std::span<int_t const>   sample_AD  = field_AD[i];
+                  std::span<int_t>         sample_LAD = buffer[i];
+
+                  sample_LAD[0] = sample_AD[0]; // reference is always retained
+                  for (size_t l = 0; l < L; ++l)
+                      sample_LAD[l + 1] = sample_AD[sample_LAA[l]];
               }
-              // NOTE: instead of reserving and appending, resize and assign might be faster
 
-              record.genotypes.emplace_back("LAD", std::move(buffer)); // create LAD field
+              emplace_narrowest(record.genotypes, "LAD", buffer, cache); // create LAD field
 
               if (!opts.keep_global_fields)
                   buffer = std::move(field_AD); // salvage dynamic memory from field_AD since it will be removed later
@@ -216,68 +688,58 @@ inline void localise_alleles(record_t &              record,
               throw decovar_error{"[Record no: {}] LAD field was not a range of integers.", record_no};
           }};
 
-        std::visit(visitor, record.genotypes[it->second].value);
+        std::visit(visitor, record.genotypes[pos].value);
     }
 
     /* LGT */
     // TODO what is the point of this?
 
     /* LPL */
-    if (auto it = field_ids.find("PL"); it != field_ids.end())
+    if (size_t const pos = find_field(record.genotypes, "PL"); pos < n_fields)
     {
         auto visitor = bio::meta::overloaded{
-          [&]<std::integral int_t>(bio::ranges::concatenated_sequences<std::vector<int_t>> & field_PL)
+          [&]<std::signed_integral int_t>(bio::ranges::concatenated_sequences<std::vector<int_t>> & field_PL)
           {
-              // correct size of PL was already checked above
-
-              auto & buffer = cache.get_buf<int_t>();
+              auto & buffer = cache.get_work_buf<int_t>("LPL");
               concatenated_sequences_create_scaffold(buffer, n_samples, bio::io::var::detail::vcf_gt_formula(L, L) + 1);
 
-              for (size_t i = 0; i < n_samples; ++i)
+              int_t const cap = effective_pl_cap<int_t>(opts.pl_cap);
+
+              // correct size of PL was already checked above; specialise for the common values of L
+              switch (L)
               {
-                  std::span<int32_t const> sample_LAA = cache.laa[i];
-                  std::span<int_t const>   sample_PL  = field_PL[i];
-                  std::span<int_t>         sample_LPL = buffer[i];
-
-                  assert(sample_PL.size() == bio::io::var::detail::vcf_gt_formula(n_alts, n_alts) + 1);
-                  assert(sample_LPL.size() == bio::io::var::detail::vcf_gt_formula(L, L) + 1);
-
-                  /* NOTE normally we would loop over [0, L]
-                   * however, the sample_LAA does not contain 0 at position 0 (for the ref), it only has the
-                   * alternative alleles. So that's why we need to subtract 1 in the mapping and why we need
-                   * to create special cases for a=0 and/or b=0
-                   */
-                  sample_LPL[0] = sample_PL[0]; // formula(0,0) is 0 and REF is always preserved
-                  for (size_t b = 1; b <= L; ++b)
-                  {
-                      sample_LPL[bio::io::var::detail::vcf_gt_formula(0, b)] =
-                        sample_PL[bio::io::var::detail::vcf_gt_formula(0, sample_LAA[b - 1])];
-
-                      for (size_t a = 1; a <= b; ++a)
-                      {
-                          assert(bio::io::var::detail::vcf_gt_formula(a, b) < sample_LPL.size());
-                          assert(bio::io::var::detail::vcf_gt_formula(sample_LAA[a - 1], sample_LAA[b - 1]) <
-                                 sample_PL.size());
-                          sample_LPL[bio::io::var::detail::vcf_gt_formula(a, b)] =
-                            sample_PL[bio::io::var::detail::vcf_gt_formula(sample_LAA[a - 1], sample_LAA[b - 1])];
-                      }
-                  }
+                  case 1:
+                      gather_LPLs(field_PL, cache.laa, buffer, local_genotypes<1>, 1, cap);
+                      break;
+                  case 2:
+                      gather_LPLs(field_PL, cache.laa, buffer, local_genotypes<2>, 2, cap);
+                      break;
+                  case 3:
+                      gather_LPLs(field_PL, cache.laa, buffer, local_genotypes<3>, 3, cap);
+                      break;
+                  case 4:
+                      gather_LPLs(field_PL, cache.laa, buffer, local_genotypes<4>, 4, cap);
+                      break;
+                  default:
+                      fill_local_genotypes(cache.local_genotypes_buf, L);
+                      gather_LPLs(field_PL, cache.laa, buffer, cache.local_genotypes_buf, L, cap);
+                      break;
               }
 
-              record.genotypes.emplace_back("LPL", std::move(buffer)); // create LPL field
+              emplace_narrowest(record.genotypes, "LPL", buffer, cache); // create LPL field
 
               if (!opts.keep_global_fields)
-                  buffer = std::move(field_PL); // salvage dynamic memory from field_AD since it will be removed later
+                  buffer = std::move(field_PL); // salvage dynamic memory from field_PL since it will be removed later
           },
           [record_no](auto &) {
               throw decovar_error{"[Record no: {}] LPL field was not a range of integers.", record_no};
           }};
 
-        std::visit(visitor, record.genotypes[it->second].value);
+        std::visit(visitor, record.genotypes[pos].value);
     }
 
     /* LAA */
-    record.genotypes.emplace_back("LAA", std::move(cache.laa)); // this comes last, because cache.laa is used before
+    emplace_laa(record.genotypes, n_alts, cache); // this comes last, because cache.laa is used before
 
     /* remove AD, GT, PL */
     if (!opts.keep_global_fields)
@@ -289,66 +751,139 @@ inline void localise_alleles(record_t &              record,
 }
 
 // this is called if want to declare all alleles as local alleles
-inline void pseudo_localise_alleles(record_t &              record,
-                                    size_t const            record_no,
-                                    header_t const &        hdr,
-                                    program_options const & opts,
-                                    cache_t &               cache)
+inline void pseudo_localise_alleles(record_t &                      record,
+                                    size_t const                    record_no,
+                                    header_t const &                hdr,
+                                    decovar::allele_options const & opts,
+                                    cache_t &                       cache)
 {
     size_t const n_alts    = record.alt.size();
     size_t const n_samples = hdr.column_labels.size() - 9;
 
     // TODO the following can be replaced once we have bio::ranges::dictionary
     record.genotypes.reserve(record.genotypes.size() + 3);
-    std::unordered_map<std::string_view, size_t> field_ids;
-    for (size_t i = 0; i < record.genotypes.size(); ++i)
-        field_ids[record.genotypes[i].id] = i;
+    size_t const n_fields = record.genotypes.size();
 
     for (std::string_view id : {"LAA", "LAD", "LGT", "LPL"})
-        if (field_ids.contains(id))
+        if (find_field(record.genotypes, id) < n_fields)
             throw decovar_error{"[Record no: {}] Cannot add {} field, because {} field already present.",
                                 record_no,
                                 id,
                                 id};
 
+    /* copies a global field into one of the cache's spare buffers, so no memory is allocated once they are warm */
+    auto copy_field = [&](size_t const pos, std::string_view const new_id)
+    {
+        auto visitor = bio::meta::overloaded{
+          [&]<std::signed_integral int_t>(bio::ranges::concatenated_sequences<std::vector<int_t>> const & field)
+          {
+              auto buffer = cache.take_spare<int_t>(new_id);
+              buffer      = field;
+              record.genotypes.emplace_back(new_id, std::move(buffer));
+          },
+          [&](auto const &) { record.genotypes.emplace_back(new_id, record.genotypes[pos].value); }};
+
+        std::visit(visitor, record.genotypes[pos].value);
+    };
+
     /* LAD */
-    if (auto it = field_ids.find("AD"); it != field_ids.end())
+    if (size_t const pos = find_field(record.genotypes, "AD"); pos < n_fields)
     {
         if (opts.keep_global_fields) // copy
-            record.genotypes.emplace_back("LAD", record.genotypes[it->second].value);
+            copy_field(pos, "LAD");
         else // rename
-            record.genotypes[it->second].id = "LAD";
+            record.genotypes[pos].id = "LAD";
     }
 
     /* LPL */
-    if (auto it = field_ids.find("PL"); it != field_ids.end())
+    if (size_t const pos = find_field(record.genotypes, "PL"); pos < n_fields)
     {
         if (opts.keep_global_fields) // copy
-            record.genotypes.emplace_back("LPL", record.genotypes[it->second].value);
+            copy_field(pos, "LPL");
         else // rename
-            record.genotypes[it->second].id = "LPL";
+            record.genotypes[pos].id = "LPL";
     }
 
     /* LAA */
-    concatenated_sequences_create_scaffold(cache.laa, n_samples, n_alts);
-    auto && [data, delim] = cache.laa.raw_data();
-    data[0]               = 1;
-    for (size_t i = 1; i <= cache.laa.concat_size(); ++i)
-        data[i] = static_cast<int32_t>((i % n_alts) + 1);
-    record.genotypes.emplace_back("LAA", std::move(cache.laa));
+    if (n_alts <= cache_t::pseudo_laa_max_alts) // the field is constant for a given n_alts and is reused
+    {
+        auto laa = cache.take_pseudo_laa(n_alts);
+        if (laa.concat_size() != n_samples * n_alts) // not built yet
+        {
+            concatenated_sequences_create_scaffold(laa, n_samples, n_alts);
+            auto && [data, delim] = laa.raw_data();
+            for (size_t i = 0; i < data.size(); ++i)
+                data[i] = static_cast<int8_t>((i % n_alts) + 1);
+        }
+
+        record.genotypes.emplace_back("LAA", std::move(laa));
+    }
+    else
+    {
+        auto fn = [&]<std::signed_integral int_t>(std::type_identity<int_t>)
+        {
+            auto laa = cache.take_spare<int_t>("LAA");
+            concatenated_sequences_create_scaffold(laa, n_samples, n_alts);
+            auto && [data, delim] = laa.raw_data();
+            for (size_t i = 0; i < data.size(); ++i)
+                data[i] = static_cast<int_t>((i % n_alts) + 1);
+            record.genotypes.emplace_back("LAA", std::move(laa));
+        };
+
+        visit_narrowest_int(1, n_alts, fn);
+    }
+}
+
+/* gives the field back as a spare buffer if one was taken; otherwise keeps the larger of the two allocations */
+template <std::signed_integral int_t>
+inline void recycle(bio::ranges::concatenated_sequences<std::vector<int_t>> & buffer,
+                    bio::ranges::concatenated_sequences<std::vector<int_t>> & field,
+                    std::string_view const                                    id,
+                    cache_t &                                                 cache)
+{
+    if (cache.give_spare(id, field))
+        return;
+    if (buffer.raw_data().first.capacity() < field.raw_data().first.capacity())
+        buffer = std::move(field);
 }
 
 void salvage_cache(record_t & record, cache_t & cache)
 {
-    // LPL and LAD have already been swapped with PL and AD, so they don't need to be salvaged
+    size_t const n_alts = record.alt.size();
 
     for (auto && [id, value] : record.genotypes)
     {
         if (id == "LAA")
         {
-            auto & laa = std::get<bio::ranges::concatenated_sequences<std::vector<int32_t>>>(value);
-            cache.laa  = std::move(laa);
-            break;
+            auto visitor = bio::meta::overloaded{
+              [&]<std::signed_integral int_t>(bio::ranges::concatenated_sequences<std::vector<int_t>> & laa)
+              {
+                  if constexpr (BIOCPP_IS_SAME(int_t, int8_t))
+                  {
+                      // only pseudo-localised records list all n_alts alleles (localised ones have L < n_alts)
+                      bool const pseudo = laa.concat_size() == laa.size() * n_alts;
+                      if (pseudo && n_alts <= cache_t::pseudo_laa_max_alts && cache.give_pseudo_laa(n_alts, laa))
+                          return;
+                  }
+                  if constexpr (BIOCPP_IS_SAME(int_t, int32_t))
+                      recycle(cache.laa, laa, "LAA", cache);
+                  else
+                      cache.give_spare("LAA", laa);
+              },
+              [](auto &) {}};
+
+            std::visit(visitor, value);
+        }
+        else if (id == "LPL" || id == "LAD")
+        {
+            // if PL and AD are not kept, the buffers already hold their memory; otherwise the fields are recycled
+            std::string_view const field_id = id;
+            auto                   visitor  = bio::meta::overloaded{
+              [&]<std::signed_integral int_t>(bio::ranges::concatenated_sequences<std::vector<int_t>> & field)
+              { recycle(cache.get_buf<int_t>(field_id), field, field_id, cache); },
+              [](auto &) {}};
+
+            std::visit(visitor, value);
         }
     }
 }
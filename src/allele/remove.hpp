@@ -27,8 +27,8 @@
 
 #include <bio/ranges/container/concatenated_sequences.hpp>
 
+#include "../decovar.hpp"
 #include "../misc.hpp"
-#include "allele.hpp"
 
 namespace _remove
 {
@@ -44,6 +44,19 @@ struct cache_t
     std::vector<std::pair<size_t, size_t>> formula_reverse_cache;
 };
 
+/* maps the index of a genotype in G-fields back to its alleles (a, b) */
+inline void update_formula_reverse_cache(size_t const n_alts, cache_t & filter_vectors) // <- in-out-param
+{
+    size_t const gt_size = bio::io::var::detail::vcf_gt_formula(n_alts, n_alts) + 1;
+    if (filter_vectors.formula_reverse_cache.size() < gt_size)
+    {
+        filter_vectors.formula_reverse_cache.resize(gt_size);
+        for (size_t b = 0; b <= n_alts; ++b)
+            for (size_t a = 0; a <= b; ++a)
+                filter_vectors.formula_reverse_cache[bio::io::var::detail::vcf_gt_formula(a, b)] = {a, b};
+    }
+}
+
 /* this needs to be run AFTER the filter-vector-R has been computed */
 inline void determine_filter_vector_AG(size_t const n_alts, cache_t & filter_vectors) // <- in-out-param
 {
@@ -63,21 +76,14 @@ inline void determine_filter_vector_AG(size_t const n_alts, cache_t & filter_vec
         }
     }
 
-    /* formula_reverse_cache */
-    if (filter_vectors.formula_reverse_cache.size() < gt_size)
-    {
-        filter_vectors.formula_reverse_cache.resize(gt_size);
-        for (size_t b = 0; b <= n_alts; ++b)
-            for (size_t a = 0; a <= b; ++a)
-                filter_vectors.formula_reverse_cache[bio::io::var::detail::vcf_gt_formula(a, b)] = {a, b};
-    }
+    update_formula_reverse_cache(n_alts, filter_vectors);
 }
 
-inline void determine_filter_vector_R(record_t::info_t const & record_info,
-                                      size_t const             record_no,
-                                      size_t const             n_alts,
-                                      program_options const &  opts,
-                                      cache_t &                filter_vectors) // <- out-param
+inline void determine_filter_vector_R(record_t::info_t const &        record_info,
+                                      size_t const                    record_no,
+                                      size_t const                    n_alts,
+                                      decovar::allele_options const & opts,
+                                      cache_t &                       filter_vectors) // <- out-param
 {
     bool has_AF = false;
 
@@ -190,10 +196,24 @@ inline void update_infos(record_t::info_t & record_info, //← in-out parameter
     }
 }
 
-inline void update_genotypes(record_t::genotypes_t & record_genotypes, //← in-out parameter
-                             header_t const &        hdr,
-                             size_t const            record_no,
-                             cache_t const &         filter_vectors)
+/* PL values are renormalised, so the smallest PL value is 0; large values are capped */
+template <typename T>
+inline void renormalise_PLs(bio::ranges::concatenated_sequences<std::vector<T>> & PLs, size_t const pl_cap)
+{
+    T const cap = effective_pl_cap<T>(pl_cap);
+    for (std::span<T> const sample_PL : PLs)
+    {
+        T const min = std::max<T>(*std::ranges::min_element(sample_PL), 0);
+        for (T & PL_value : sample_PL)
+            PL_value = std::min<T>(PL_value - min, cap);
+    }
+}
+
+inline void update_genotypes(record_t::genotypes_t &         record_genotypes, //← in-out parameter
+                             header_t const &                hdr,
+                             size_t const                    record_no,
+                             decovar::allele_options const & opts,
+                             cache_t const &                 filter_vectors)
 {
     std::span<int const> selected_filter_vector{};
 
@@ -240,16 +260,8 @@ inline void update_genotypes(record_t::genotypes_t & record_genotypes, //← in-
               }
               assert(raw_data.second.back() == raw_data.first.size());
 
-              if (id == "PL") // PL values are renormalised, so the smallest PL value is 0
-              {
-                  for (std::span<T> const sample_PL : vec)
-                  {
-                      T const min = *std::ranges::min_element(sample_PL);
-                      if (min > 0)
-                          for (T & PL_value : sample_PL)
-                              PL_value -= min;
-                  }
-              }
+              if (id == "PL")
+                  renormalise_PLs(vec, opts.pl_cap);
           }};
 
         switch (format.number)
@@ -269,6 +281,9 @@ inline void update_genotypes(record_t::genotypes_t & record_genotypes, //← in-
             default:
                 break;
         }
+
+        if (id == "PL" && opts.pl_cap != 0) // capped values may fit into a narrower type
+            narrow_genotype_field(value);
     }
 }
 
@@ -310,11 +325,11 @@ inline void fix_GT(record_t::genotypes_t & record_genotypes, //← in-out parame
 }
 
 // returns true if all alleles were removed and the entire record should be skipped
-[[nodiscard]] inline bool remove_rare_alleles(record_t &              record,
-                                              size_t const            record_no,
-                                              header_t const &        hdr,
-                                              program_options const & opts,
-                                              cache_t &               filter_vectors)
+[[nodiscard]] inline bool remove_rare_alleles(record_t &                      record,
+                                              size_t const                    record_no,
+                                              header_t const &                hdr,
+                                              decovar::allele_options const & opts,
+                                              cache_t &                       filter_vectors)
 {
     size_t n_alts = record.alt.size();
 
@@ -340,7 +355,7 @@ inline void fix_GT(record_t::genotypes_t & record_genotypes, //← in-out parame
         update_infos(record.info, hdr, record_no, filter_vectors);
 
         /* update genotypes */
-        update_genotypes(record.genotypes, hdr, record_no, filter_vectors);
+        update_genotypes(record.genotypes, hdr, record_no, opts, filter_vectors);
 
         /* fix GT values after alleles have been removed */
         fix_GT(record.genotypes, record_no, filter_vectors);
@@ -22,87 +22,358 @@
 
 #pragma once
 
+#include <array>
 #include <ranges>
+#include <string_view>
 #include <variant>
 
 #include <bio/ranges/container/concatenated_sequences.hpp>
 
+#include "../decovar.hpp"
 #include "../misc.hpp"
-#include "allele.hpp"
 #include "remove.hpp"
 
 namespace _split
 {
 
-enum which_t
+/* maximum number of records that a single record can be split into */
+inline constexpr size_t max_classes = 16;
+
+/* indexes of the values that are retained in one of the output records */
+struct plan_t
+{
+    std::vector<size_t> A;
+    std::vector<size_t> R;
+    std::vector<size_t> G;
+};
+
+struct cache_t
+{
+    // class of every allele; REF (position 0) is part of every class
+    std::vector<size_t> allele_classes;
+
+    // one plan and one output record per class; output records are recycled
+    std::vector<plan_t>   plans;
+    std::vector<record_t> records;
+
+    // indexes of the classes that contain at least one ALT allele
+    std::vector<size_t> used_classes;
+
+    _remove::cache_t filter_vectors;
+};
+
+enum allele_type : size_t
 {
-    leq,
-    gt
+    substitution, // SNVs and MNVs
+    indel,
+    symbolic, // <DEL>, <INS:ME>, <*>, *
+    breakend,
+    n_allele_types
 };
 
-inline void determine_filter_vector_R(record_t const &        record,
-                                      program_options const & opts,
-                                      which_t const           which,     // if true, remove lengths LEQ option
-                                      _remove::cache_t &      filter_vectors) // <- out-param
+inline allele_type classify_allele(std::string_view const alt, size_t const ref_size)
+{
+    if (alt.empty())
+        return indel;
+    if (alt.front() == '<' || alt == "*")
+        return symbolic;
+    if (alt.find_first_of("[]") != std::string_view::npos ||
+        (alt.size() > 1 && (alt.front() == '.' || alt.back() == '.'))) // single breakends
+        return breakend;
+    return alt.size() == ref_size ? substitution : indel;
+}
+
+/* number of thresholds that the allele is longer than */
+inline size_t length_class(size_t const allele_length, decovar::allele_options const & opts)
+{
+    return std::ranges::lower_bound(opts.split_by_length, allele_length) - opts.split_by_length.begin();
+}
+
+/* if both are given, alleles are split by type and within each type by length */
+inline size_t n_classes(decovar::allele_options const & opts)
+{
+    return (opts.split_by_class ? n_allele_types : 1) * (opts.split_by_length.size() + 1);
+}
+
+inline size_t allele_class(std::string_view const alt, size_t const ref_size, decovar::allele_options const & opts)
+{
+    size_t c = length_class(alt.size(), opts);
+    if (opts.split_by_class)
+        c += classify_allele(alt, ref_size) * (opts.split_by_length.size() + 1);
+    return c;
+}
+
+inline void determine_classes(record_t const & record, decovar::allele_options const & opts, cache_t & cache)
 {
     size_t const n_alts = record.alt.size();
 
-    /* filtered alleles R */
-    filter_vectors.R.clear();
-    filter_vectors.R.resize(n_alts + 1);
-    filter_vectors.R[0] = 0; // REF is never filtered
+    cache.allele_classes.resize(n_alts + 1);
+    cache.allele_classes[0] = 0;
     for (size_t i = 0; i < n_alts; ++i)
-        filter_vectors.R[i + 1] = (record.alt[i].size() <= opts.split_by_length) == (which == leq);
+        cache.allele_classes[i + 1] = allele_class(record.alt[i], record.ref.size(), opts);
 }
 
-bool needs_splitting(record_t const & record, program_options const & opts)
+inline bool needs_splitting(record_t const & record, decovar::allele_options const & opts)
 {
     size_t n_alts = record.alt.size();
     if (n_alts <= 1)
         return false;
 
-    bool has_shorter = false;
-    bool has_longer  = false;
-
+    size_t const first_class = allele_class(record.alt[0], record.ref.size(), opts);
     for (auto const & alt_allele : record.alt)
+        if (allele_class(alt_allele, record.ref.size(), opts) != first_class)
+            return true;
+
+    return false;
+}
+
+/* this needs to be run AFTER the allele classes have been determined */
+inline void determine_plans(size_t const n_alts, size_t const n_classes, cache_t & cache)
+{
+    if (cache.plans.size() < n_classes)
+        cache.plans.resize(n_classes);
+
+    cache.used_classes.clear();
+    for (size_t c = 0; c < n_classes; ++c)
     {
-        if (alt_allele.size() <= opts.split_by_length)
-            has_shorter = true;
-        if (alt_allele.size() > opts.split_by_length)
-            has_longer = true;
+        plan_t & plan = cache.plans[c];
+
+        plan.R.clear();
+        plan.R.push_back(0); // REF is always retained
+        for (size_t i = 1; i <= n_alts; ++i)
+            if (cache.allele_classes[i] == c)
+                plan.R.push_back(i);
+
+        plan.A.clear();
+        for (size_t i = 1; i < plan.R.size(); ++i)
+            plan.A.push_back(plan.R[i] - 1);
+
+        // R is sorted, so the genotypes are gathered in VCF order
+        plan.G.clear();
+        for (size_t b = 0; b < plan.R.size(); ++b)
+            for (size_t a = 0; a <= b; ++a)
+                plan.G.push_back(bio::io::var::detail::vcf_gt_formula(plan.R[a], plan.R[b]));
+
+        if (!plan.A.empty())
+            cache.used_classes.push_back(c);
     }
 
-    return has_shorter && has_longer;
+    if (cache.records.size() < n_classes)
+        cache.records.resize(n_classes);
+
+    _remove::update_formula_reverse_cache(n_alts, cache.filter_vectors);
 }
 
-// returns true if all alleles were removed and the entire record should be skipped
-inline void remove_alleles(record_t &              record,
-                           size_t const            record_no,
-                           which_t const           which,
-                           header_t const &        hdr,
-                           program_options const & opts,
-                           _remove::cache_t &      filter_vectors)
+template <typename T, typename variant_t>
+inline T & establish(variant_t & variant)
 {
-    size_t n_alts = record.alt.size();
+    if (!std::holds_alternative<T>(variant))
+        variant = T{};
+    return std::get<T>(variant);
+}
+
+inline std::vector<size_t> const & select_indexes(plan_t const & plan, int32_t const number)
+{
+    switch (number)
+    {
+        case bio::io::var::header_number::A:
+            return plan.A;
+        case bio::io::var::header_number::R:
+            return plan.R;
+        default:
+            return plan.G;
+    }
+}
+
+inline void partition_infos(record_t const & record,
+                            size_t const     record_no,
+                            header_t const & hdr,
+                            cache_t &        cache)
+{
+    size_t const n_alts = record.alt.size();
+
+    for (size_t c : cache.used_classes)
+        cache.records[c].info.resize(record.info.size());
+
+    for (size_t j = 0; j < record.info.size(); ++j)
+    {
+        std::string_view         id     = record.info[j].id;
+        header_t::info_t const & info   = hdr.infos[hdr.string_to_info_pos().at(id)];
+        bool const               is_A   = info.number == bio::io::var::header_number::A;
+        bool const               is_R   = info.number == bio::io::var::header_number::R;
+        size_t const             n_vals = is_A ? n_alts : n_alts + 1;
+
+        for (size_t c : cache.used_classes)
+            cache.records[c].info[j].id = id;
 
-    determine_filter_vector_R(record, opts, which, filter_vectors);
-    _remove::determine_filter_vector_AG(n_alts, filter_vectors);
+        if (!is_A && !is_R)
+        {
+            for (size_t c : cache.used_classes)
+                cache.records[c].info[j].value = record.info[j].value;
+            continue;
+        }
 
-    log(opts, "filter_vector.A: {}\n", filter_vectors.A);
-    log(opts, "filter_vector.R: {}\n", filter_vectors.R);
-    log(opts, "filter_vector.G: {}\n", filter_vectors.G);
+        auto visitor = bio::meta::overloaded{
+          [&](auto const &) {
+              throw decovar_error{"[Record no: {}] Expected a vector when trimming field {}.", record_no, id};
+          },
+          [&]<typename T>(std::vector<T> const & vec)
+          {
+              if (vec.size() != n_vals)
+              {
+                  throw decovar_error{
+                    "[Record no: {}] Expected {} elements in field {}, but got {}. A single '.' "
+                    "as placeholder is currently not supported.",
+                    record_no,
+                    n_vals,
+                    id,
+                    vec.size()};
+              }
+
+              for (size_t c : cache.used_classes)
+              {
+                  std::vector<T> & out = establish<std::vector<T>>(cache.records[c].info[j].value);
+                  out.clear();
+                  for (size_t const i : select_indexes(cache.plans[c], info.number))
+                      out.push_back(vec[i]);
+              }
+          }};
+
+        std::visit(visitor, record.info[j].value);
+    }
+}
+
+/* every sample's values are read once and gathered into all output records */
+inline void partition_genotypes(record_t const &                record,
+                                size_t const                    record_no,
+                                header_t const &                hdr,
+                                decovar::allele_options const & opts,
+                                cache_t &                       cache)
+{
+    size_t const n_alts    = record.alt.size();
+    size_t const n_samples = hdr.column_labels.size() - 9;
+
+    for (size_t c : cache.used_classes)
+        cache.records[c].genotypes.resize(record.genotypes.size());
+
+    for (size_t j = 0; j < record.genotypes.size(); ++j)
+    {
+        std::string_view           id     = record.genotypes[j].id;
+        header_t::format_t const & format = hdr.formats[hdr.string_to_format_pos().at(id)];
 
-    /* update alts */
-    _remove::remove_by_indexes(record.alt, filter_vectors.A);
+        for (size_t c : cache.used_classes)
+            cache.records[c].genotypes[j].id = id;
 
-    /* update info */
-    _remove::update_infos(record.info, hdr, record_no, filter_vectors);
+        size_t n_vals = 0;
+        switch (format.number)
+        {
+            case bio::io::var::header_number::A:
+                n_vals = n_alts;
+                break;
+            case bio::io::var::header_number::R:
+                n_vals = n_alts + 1;
+                break;
+            case bio::io::var::header_number::G:
+                n_vals = bio::io::var::detail::vcf_gt_formula(n_alts, n_alts) + 1;
+                break;
+            default:
+                for (size_t c : cache.used_classes)
+                    cache.records[c].genotypes[j].value = record.genotypes[j].value;
+                continue;
+        }
+
+        auto visitor = bio::meta::overloaded{
+          [&](auto const &) {
+              throw decovar_error{"[Record no: {}] Expected a vector when trimming field {}.", record_no, id};
+          },
+          [&]<typename T>(bio::ranges::concatenated_sequences<std::vector<T>> const & in)
+          {
+              if (in.concat_size() != n_samples * n_vals)
+              {
+                  throw decovar_error{
+                    "[Record no: {}] Currently, every sample must be diploid and must contain the "
+                    "the correct number of values (e.g. no single '.' placeholder allowed).",
+                    record_no};
+              }
+
+              using out_t = bio::ranges::concatenated_sequences<std::vector<T>>;
+              std::array<out_t *, max_classes>                     outs{};
+              std::array<std::vector<size_t> const *, max_classes> indexes{};
+              size_t const                                         n_out = cache.used_classes.size();
+
+              for (size_t k = 0; k < n_out; ++k)
+              {
+                  size_t const c = cache.used_classes[k];
+                  outs[k]        = &establish<out_t>(cache.records[c].genotypes[j].value);
+                  indexes[k]     = &select_indexes(cache.plans[c], format.number);
+                  concatenated_sequences_create_scaffold(*outs[k], n_samples, indexes[k]->size());
+              }
+
+              for (size_t i = 0; i < n_samples; ++i)
+              {
+                  std::span<T const> const in_values = in[i];
+                  for (size_t k = 0; k < n_out; ++k)
+                  {
+                      std::span<T> const out_values = (*outs[k])[i];
+                      for (size_t l = 0; l < out_values.size(); ++l)
+                          out_values[l] = in_values[(*indexes[k])[l]];
+                  }
+              }
+
+              if (id == "PL")
+                  for (size_t k = 0; k < n_out; ++k)
+                      _remove::renormalise_PLs(*outs[k], opts.pl_cap);
+          }};
+
+        std::visit(visitor, record.genotypes[j].value);
+
+        if (id == "PL" && opts.pl_cap != 0) // capped values may fit into a narrower type
+            for (size_t c : cache.used_classes)
+                narrow_genotype_field(cache.records[c].genotypes[j].value);
+    }
+}
+
+/* Partitions the alleles of record into the classes determined before; one output record is created for every class
+ * that contains at least one ALT allele. The input record is only read. */
+inline void partition_alleles(record_t const &                record,
+                              size_t const                    record_no,
+                              size_t const                    n_classes,
+                              header_t const &                hdr,
+                              decovar::allele_options const & opts,
+                              cache_t &                       cache)
+{
+    size_t const n_alts = record.alt.size();
+    assert(n_classes <= max_classes);
+
+    determine_plans(n_alts, n_classes, cache);
+
+    for (size_t k = 0; k < cache.used_classes.size(); ++k)
+    {
+        size_t const   c    = cache.used_classes[k];
+        record_t &     out  = cache.records[c];
+        plan_t const & plan = cache.plans[c];
+
+        log(opts, "class {}: alleles {}\n", c, plan.R);
+
+        out.chrom = record.chrom;
+        out.pos   = record.pos;
+        out.id    = record.id;
+        if (out.id != ".")
+            fmt::format_to(std::back_inserter(out.id), "_split{}", k + 1);
+        out.ref = record.ref;
+        out.alt.resize(plan.A.size());
+        for (size_t i = 0; i < plan.A.size(); ++i)
+            out.alt[i] = record.alt[plan.A[i]];
+        out.qual   = record.qual;
+        out.filter = record.filter;
+    }
 
-    /* update genotypes */
-    _remove::update_genotypes(record.genotypes, hdr, record_no, filter_vectors);
+    partition_infos(record, record_no, hdr, cache);
+    partition_genotypes(record, record_no, hdr, opts, cache);
 
     /* fix GT values after alleles have been removed */
-    _remove::fix_GT(record.genotypes, record_no, filter_vectors);
+    for (size_t c : cache.used_classes)
+        _remove::fix_GT(cache.records[c].genotypes, record_no, cache.filter_vectors);
 }
 
 } // namespace _split
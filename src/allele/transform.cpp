@@ -0,0 +1,255 @@
+// MIT License
+//
+// Copyright (c) 2023 deCODE Genetics
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <cstddef>
+#include <limits>
+#include <optional>
+#include <span>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include <bio/io/exception.hpp>
+#include <bio/io/var/header.hpp>
+#include <bio/io/var/misc.hpp>
+
+#include "../decovar.hpp"
+#include "../misc.hpp"
+#include "../thread_pool.hpp"
+#include "allele.hpp"
+#include "localise.hpp"
+#include "remove.hpp"
+#include "split.hpp"
+
+namespace decovar
+{
+
+struct allele_transform::impl
+{
+    allele_options const opts;
+    header_t             hdr;
+    size_t               n_samples = 0;
+    bool                 localise  = false;
+    thread_pool &        pool;
+
+    /* caches */
+    _remove::cache_t                filter_vectors;
+    _split::cache_t                 split_cache;
+    std::vector<_localise::cache_t> localise_caches; // one per part of a batch; they share their spare buffers
+
+    /* results */
+    std::vector<record_t> records;
+    std::vector<size_t>   record_nos;
+    size_t                n_records = 0;
+
+    std::vector<size_t> costs;
+    std::vector<size_t> part_of; // per record; heavy records are localised by all threads
+
+    impl(allele_options const & opts, header_t const & input_header, thread_pool & pool) :
+      opts{opts},
+      hdr{input_header},
+      localise{opts.local_alleles > 0ul || opts.auto_local_alleles},
+      pool{pool},
+      localise_caches(pool.size() + 1)
+    {
+        if (localise)
+        {
+            if (!hdr.string_to_format_pos().contains("LAA"))
+                hdr.formats.push_back(bio::io::var::reserved_formats.at("LAA"));
+            if (hdr.string_to_format_pos().contains("AD") && !hdr.string_to_format_pos().contains("LAD"))
+                hdr.formats.push_back(bio::io::var::reserved_formats.at("LAD"));
+            // if (hdr.string_to_format_pos().contains("GT") && !hdr.string_to_format_pos().contains("LGT"))
+            //     hdr.formats.push_back(bio::io::var::reserved_formats.at("LGT"));
+            if (hdr.string_to_format_pos().contains("PL") && !hdr.string_to_format_pos().contains("LPL"))
+                hdr.formats.push_back(bio::io::var::reserved_formats.at("LPL"));
+
+            hdr.add_missing();
+        }
+
+        n_samples = hdr.column_labels.size() > 9 ? hdr.column_labels.size() - 9 : 0;
+
+        for (_localise::cache_t & cache : localise_caches)
+            cache.spares = localise_caches[0].spares;
+    }
+
+    /* swaps record into the results */
+    void push_back(record_t & record, size_t const record_no)
+    {
+        if (n_records == records.size())
+        {
+            records.emplace_back();
+            record_nos.emplace_back();
+        }
+
+        std::swap(records[n_records], record);
+        record_nos[n_records] = record_no;
+        ++n_records;
+    }
+
+    /* remove rare alleles, then split; the created records are added to the results */
+    void remove_and_split(record_t & record, size_t const record_no)
+    {
+        if (record.alt.size() > 1ul && opts.rare_af_threshold != 0.0)
+        {
+            log(opts, "↓ record no {} allelle-removal begin.\n", record_no);
+            bool all_alleles_removed = _remove::remove_rare_alleles(record, record_no, hdr, opts, filter_vectors);
+            log(opts, "↑ record no {} allelle-removal end.\n", record_no);
+            if (all_alleles_removed)
+                return;
+        }
+
+        if ((!opts.split_by_length.empty() || opts.split_by_class) && _split::needs_splitting(record, opts))
+        {
+            log(opts, "↓ record no {} splitting begin.\n", record_no);
+
+            _split::determine_classes(record, opts, split_cache);
+            _split::partition_alleles(record, record_no, _split::n_classes(opts), hdr, opts, split_cache);
+
+            log(opts, "↑ record no {} splitting end.\n", record_no);
+
+            for (size_t c : split_cache.used_classes)
+                push_back(split_cache.records[c], record_no);
+            return;
+        }
+
+        push_back(record, record_no);
+    }
+
+    void localise_record(record_t &           record,
+                         size_t const         input_no,
+                         _localise::cache_t & cache,
+                         thread_pool * const  sample_pool)
+    {
+        size_t const L = opts.auto_local_alleles ? _localise::choose_local_alleles(record, input_no, hdr, opts, cache)
+                       : record.alt.size() > opts.local_alleles ? opts.local_alleles
+                                                                : 0ul;
+
+        if (L > 0)
+        {
+            log(opts, "↓ record no {} allelle-localisation begin.\n", input_no);
+            _localise::localise_alleles(record, input_no, L, hdr, opts, cache, sample_pool);
+            log(opts, "↑ record no {} allelle-localisation end.\n", input_no);
+        }
+        else if (opts.transform_all)
+        {
+            log(opts, "↓ record no {} allelle-pseudo-localisation begin.\n", input_no);
+            _localise::pseudo_localise_alleles(record, input_no, hdr, opts, cache);
+            log(opts, "↑ record no {} allelle-pseudo-localisation end.\n", input_no);
+        }
+    }
+
+    /* estimated cost of localising a record: PL values */
+    size_t cost(record_t const & record) const
+    {
+        size_t const n_alts = record.alt.size();
+        return n_samples * (bio::io::var::detail::vcf_gt_formula(n_alts, n_alts) + 1);
+    }
+
+    void localise_results()
+    {
+        std::span<record_t> const results{records.data(), n_records};
+        size_t const              n_parts = std::min(localise_caches.size(), results.size());
+
+        /* Heavy records would stall the part they are in; they are localised one after the other with the samples
+         * divided between the threads. The remaining records are divided into parts of similar total cost. */
+        costs.resize(results.size());
+        size_t total_cost = 0;
+        for (size_t i = 0; i < results.size(); ++i)
+            total_cost += (costs[i] = cost(results[i]));
+
+        size_t const heavy_cost = n_parts > 1 ? total_cost / n_parts : std::numeric_limits<size_t>::max();
+        size_t       light_cost = 0;
+        for (size_t i = 0; i < results.size(); ++i)
+            light_cost += costs[i] > heavy_cost ? 0 : costs[i];
+
+        part_of.resize(results.size());
+        for (size_t i = 0, cum_cost = 0; i < results.size(); ++i)
+        {
+            if (costs[i] > heavy_cost)
+            {
+                part_of[i] = n_parts; // heavy
+            }
+            else
+            {
+                part_of[i] = std::min(n_parts - 1, cum_cost * n_parts / std::max<size_t>(light_cost, 1));
+                cum_cost += costs[i];
+            }
+        }
+
+        for (size_t i = 0; i < results.size(); ++i)
+            if (part_of[i] == n_parts)
+                localise_record(results[i], record_nos[i], localise_caches[0], &pool);
+
+        pool.parallel_for(n_parts,
+                          [&](size_t const p)
+                          {
+                              for (size_t i = 0; i < results.size(); ++i)
+                                  if (part_of[i] == p)
+                                      localise_record(results[i], record_nos[i], localise_caches[p], nullptr);
+                          });
+    }
+
+    std::span<record_t> process(std::span<record_t> const input, std::span<size_t const> const input_nos)
+    {
+        /* salvage memory of the earlier results (or of the records that the caller swapped in); any cache can take
+         * a record's fields, because the spare buffers are shared */
+        if (localise)
+            for (size_t i = 0; i < n_records; ++i)
+                _localise::salvage_cache(records[i], localise_caches[i % localise_caches.size()]);
+
+        n_records = 0;
+        for (size_t i = 0; i < input.size(); ++i)
+            remove_and_split(input[i], input_nos[i]);
+
+        if (localise)
+            localise_results();
+
+        return {records.data(), n_records};
+    }
+};
+
+allele_transform::allele_transform(allele_options const & opts, header_t const & input_header, thread_pool & pool) :
+  pimpl{std::make_unique<impl>(opts, input_header, pool)}
+{}
+
+allele_transform::allele_transform(allele_transform &&) noexcept             = default;
+allele_transform & allele_transform::operator=(allele_transform &&) noexcept = default;
+allele_transform::~allele_transform()                                        = default;
+
+header_t const & allele_transform::header() const noexcept
+{
+    return pimpl->hdr;
+}
+
+std::span<record_t> allele_transform::process(std::span<record_t> const     records,
+                                              std::span<size_t const> const record_nos)
+{
+    return pimpl->process(records, record_nos);
+}
+
+std::span<size_t const> allele_transform::record_nos() const noexcept
+{
+    return {pimpl->record_nos.data(), pimpl->n_records};
+}
+
+} // namespace decovar
@@ -0,0 +1,102 @@
+// MIT License
+//
+// Copyright (c) 2023 deCODE Genetics
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+#include <cstddef>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include <bio/io/var/misc.hpp>
+
+#include "memory_budget.hpp"
+#include "misc.hpp"
+
+/* A reusable batch of records for stages that process several records at once. Records are swapped into the batch,
+ * so the producer gets the buffers of earlier records back and refills them instead of allocating. */
+class record_batch
+{
+public:
+    static constexpr size_t max_records = 256;
+    static constexpr size_t max_values  = 1ul << 26; // estimated genotype values; bounds the memory of a batch
+    static constexpr size_t min_records = 32;        // before an exhausted memory budget ends a batch
+
+private:
+    std::vector<record_t> records_;
+    std::vector<size_t>   record_nos_;
+    memory_budget &       budget;
+    size_t                n_samples = 0;
+    size_t                n_records = 0;
+    size_t                n_values  = 0;
+    size_t                n_bytes   = 0; // accounted in the memory budget
+
+public:
+    record_batch(size_t const n_samples, memory_budget & budget) :
+      records_(max_records), record_nos_(max_records), budget{budget}, n_samples{n_samples}
+    {}
+
+    /* takes the contents of record; record receives the buffers of an earlier record */
+    void push_back(record_t & record, size_t const record_no)
+    {
+        size_t const n_alts = record.alt.size();
+        n_values += (bio::io::var::detail::vcf_gt_formula(n_alts, n_alts) + 1) * record.genotypes.size() * n_samples;
+
+        std::swap(records_[n_records], record);
+        record_nos_[n_records] = record_no;
+
+        size_t const bytes = record_bytes(records_[n_records]);
+        n_bytes += bytes;
+        budget.add(bytes);
+
+        ++n_records;
+    }
+
+    /* whether the batch should be processed before adding more records; a small batch is not ended by the memory
+     * budget, so that the records of a batch can still be localised in parallel */
+    bool full() const
+    {
+        return n_records == max_records || n_values >= max_values || (n_records >= min_records && budget.exhausted());
+    }
+
+    bool empty() const noexcept { return n_records == 0; }
+
+    size_t size() const noexcept { return n_records; }
+
+    std::span<record_t> records() noexcept { return {records_.data(), n_records}; }
+
+    /* bytes accounted in the memory budget for the records; whoever consumes them releases the bytes */
+    size_t bytes() const noexcept { return n_bytes; }
+
+    /* number of the input record that records()[i] was created from */
+    size_t record_no(size_t const i) const noexcept { return record_nos_[i]; }
+
+    std::span<size_t const> record_nos() const noexcept { return {record_nos_.data(), n_records}; }
+
+    void clear() noexcept
+    {
+        n_records = 0;
+        n_values  = 0;
+        n_bytes   = 0;
+    }
+};
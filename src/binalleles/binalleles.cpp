@@ -22,9 +22,12 @@
 
 #include "binalleles.hpp"
 
+#include <array>
 #include <bits/ranges_algo.h>
 #include <cstddef>
 #include <cstdint>
+#include <optional>
+#include <utility>
 #include <strings.h>
 #include <variant>
 
@@ -38,8 +41,13 @@
 
 #include <sharg/all.hpp>
 
+#include "../decovar.hpp"
 #include "../generator.hpp"
+#include "../memory_budget.hpp"
 #include "../misc.hpp"
+#include "../read_ahead.hpp"
+#include "../thread_pool.hpp"
+#include "plink.hpp"
 #include "bio/io/misc.hpp"
 #include "bio/io/var/record.hpp"
 
@@ -55,15 +63,18 @@ program_options parse_options(sharg::parser & parser)
       sharg::config{.short_id = 'v', .long_id = "verbose", .description = "Print diagnostics to stderr."});
 
     parser.add_subsection("Input / Output:");
-    parser.add_positional_option(opts.input_file,
-                                 sharg::config{.description = "Path to input file or '-' for stdin.",
+    parser.add_positional_option(opts.input_files,
+                                 sharg::config{.description = "Paths to input files or '-' for stdin. Several files "
+                                                              "are processed at the same time, sharing the threads.",
                                                .required    = true,
                                                .validator   = input_file_or_stdin_validator{{"vcf", "vcf.gz", "bcf"}}});
     parser.add_option(opts.output_file,
                       sharg::config{
                         .short_id    = 'o',
                         .long_id     = "output",
-                        .description = "Path to output file or '-' for stdout.",
+                        .description = "Path to output file or '-' for stdout. With several input files, the path "
+                                       "must contain {} which is replaced by the input file's name without "
+                                       "extension, e.g. out/{}.bcf; as must the paths of additional outputs.",
                         .validator   = output_file_or_stdout_validator{sharg::output_file_open_options::create_new,
                                                                        {"vcf", "vcf.gz", "bcf"}}
     });
@@ -79,6 +90,13 @@ program_options parse_options(sharg::parser & parser)
                         .validator   = sharg::value_list_validator{'a', 'b', 'u', 'z', 'v'}
     });
 
+    parser.add_option(opts.plink_prefix,
+                      sharg::config{
+                        .long_id     = "plink",
+                        .description = "Additionally write the biallelic (pseudo-)records as PLINK 1 binary files "
+                                       "PREFIX.bed, PREFIX.bim and PREFIX.fam. Genotypes are decided by the smallest "
+                                       "PL; multi-allelic records and records without PL are not included."});
+
     parser.add_subsection("Allele binning by length:");
 
     parser.add_line(
@@ -98,42 +116,68 @@ program_options parse_options(sharg::parser & parser)
                                                  "alleles of "
                                                  "the same length. This options enables writing of all records."});
 
+    parser.add_option(opts.pl_cap,
+                      sharg::config{
+                        .long_id     = "pl-cap",
+                        .description = "Cap the PL values of the created records at this value. Values of 127 or "
+                                       "less allow storing the field as 8bit integers. 0 → no capping.",
+                        .validator   = sharg::arithmetic_range_validator{0, 32767}
+    });
+
     parser.add_subsection("Performance:");
     parser.add_option(opts.threads,
                       sharg::config{
                         .short_id    = '@',
                         .long_id     = "threads",
-                        .description = "Maximum number of threads to use.",
-                        .validator   = sharg::arithmetic_range_validator{2u, std::thread::hardware_concurrency() * 2}
+                        .description = "Maximum number of threads to use for all input files together. 0 → all CPUs "
+                                       "available to the process, i.e. respecting the CPU affinity mask and cgroup "
+                                       "CPU quota. The default is the number of available CPUs, but at most 8.",
+                        .validator   = sharg::arithmetic_range_validator{0ul, std::max<size_t>(2, available_cpus() * 2)}
     });
 
+    parser.add_option(opts.max_memory,
+                      sharg::config{
+                        .long_id     = "max-memory",
+                        .description = "Approximate limit in MiB for the records held between reading and writing. "
+                                       "Reading pauses while it is exceeded. Buffers of the (de)compression threads "
+                                       "are not included. 0 → no limit."});
+
+    std::string cpu_affinity_arg;
+    parser.add_option(cpu_affinity_arg,
+                      sharg::config{
+                        .long_id     = "cpu-affinity",
+                        .description = "Pin the thread groups to CPUs, given as READER:TRANSFORM:WRITER with each "
+                                       "group a CPU list like 0-3,8. Reader: decompression and decoding; transform: "
+                                       "main thread and worker pool; writer: encoding and compression. An empty list "
+                                       "leaves a group unpinned. Buffers are allocated by the threads that fill them, "
+                                       "so pinning the groups to one socket keeps their memory on its NUMA node."});
+
     parser.parse();
+
+    opts.threads    = resolve_thread_count(opts.threads);
+    opts.affinity   = parse_cpu_affinity(cpu_affinity_arg);
+    opts.plink_rows = !opts.plink_prefix.empty();
+    validate_output_templates(opts.input_files,
+                              {
+                                {.path = opts.output_file, .extensions = {"vcf", "vcf.gz", "bcf"}},
+                                {.path = opts.plink_prefix, .suffixes = {".bed", ".bim", ".fam"}}
+    });
     return opts;
 }
 
-template <typename int_t>
-bio::ranges::concatenated_sequences<std::vector<int_t>> & establish_PLs(
-  bio::io::var::genotype_element_value_type<bio::io::ownership::deep> & variant,
-  size_t const                                                          n_samples)
+/* threads of a file that may use the given number of threads */
+file_threads_t io_threads(size_t const threads)
 {
-    if (!std::holds_alternative<bio::ranges::concatenated_sequences<std::vector<int_t>>>(variant))
-    {
-        bio::ranges::concatenated_sequences<std::vector<int_t>> newGTs;
-        concatenated_sequences_create_scaffold(newGTs, n_samples, 3ul);
-        variant = std::move(newGTs);
-    }
-    return std::get<bio::ranges::concatenated_sequences<std::vector<int_t>>>(variant);
+    return divide_file_threads(threads, 2); // main thread and decoding
 }
 
-void main(sharg::parser & parser)
+/* transforms opts.input_file; the pool is shared with the files that are processed at the same time */
+void binalleles_file(program_options const & opts, size_t const threads, decovar::thread_pool & pool)
 {
-    program_options opts = parse_options(parser);
-
-    size_t threads        = opts.threads - 1; // subtract one for the main thread
-    size_t reader_threads = threads / 3;
-    size_t writer_threads = threads - reader_threads;
+    auto const [reader_threads, writer_threads, pool_threads] = io_threads(threads);
 
     /* setup reader */
+    pin_thread_group(opts.affinity.reader);
     bio::io::var::reader_options reader_opts{.record = record_t{},
                                              .stream_options =
                                                bio::io::transparent_istream_options{.threads = reader_threads + 1}};
@@ -141,238 +185,83 @@ void main(sharg::parser & parser)
                                                            : bio::io::var::reader{opts.input_file, reader_opts};
 
     /* setup writer */
+    pin_thread_group(opts.affinity.writer);
     bio::io::var::writer writer = create_writer(opts.output_file, opts.output_file_type, writer_threads);
 
-    /* ========= setup header =========== */
-    if (opts.bin_by_length) // we need to create a new header
-    {
-        bio::io::var::header new_hdr = reader.header(); // create copy
-
-        new_hdr.infos.clear();
-        bio::io::var::header::format_t ref{
-          .id          = "REFBIN_INDEXES",
-          .number      = bio::io::var::header_number::dot,
-          .type        = "Integer",
-          .type_id     = bio::io::var::value_type_id::vector_of_int16, //TODO configure size?
-          .description = "Indexes of original alleles binned as the reference.",
-        };
-        new_hdr.infos.push_back(std::move(ref));
-
-        bio::io::var::header::format_t ref_max{
-          .id          = "REFBIN_MAXLEN",
-          .number      = 1,
-          .type        = "Integer",
-          .type_id     = bio::io::var::value_type_id::int32,
-          .description = "Maximum allele length in REFBIN.",
-        };
-        new_hdr.infos.push_back(std::move(ref_max));
-
-        bio::io::var::header::format_t alt{
-          .id          = "ALTBIN_INDEXES",
-          .number      = bio::io::var::header_number::dot,
-          .type        = "Integer",
-          .type_id     = bio::io::var::value_type_id::vector_of_int16, //TODO configure size?
-          .description = "Indexes of original alleles binned as the ALT.",
-        };
-        new_hdr.infos.push_back(std::move(alt));
-
-        bio::io::var::header::format_t alt_min{
-          .id          = "ALTBIN_MINLEN",
-          .number      = 1,
-          .type        = "Integer",
-          .type_id     = bio::io::var::value_type_id::int32,
-          .description = "Minimum allale length in ALTBIN.",
-        };
-        new_hdr.infos.push_back(std::move(alt_min));
-
-        new_hdr.formats.clear();
-        new_hdr.formats.push_back(bio::io::var::reserved_formats.at("GT"));
-        new_hdr.formats.push_back(bio::io::var::reserved_formats.at("PL"));
-
-        new_hdr.add_missing();
-        writer.set_header(std::move(new_hdr));
-    }
-    else // just use existing header as-is
-    {
-        writer.set_header(reader.header());
-    }
+    /* the records of one input record are computed in parallel */
+    decovar::binalleles_transform transform{opts, reader.header(), pool};
 
+    writer.set_header(transform.header());
     bio::io::var::header const & hdr = writer.header();
-    if (hdr.column_labels.size() < 10)
-        throw decovar_error{"VCF file contains no samples."};
-    size_t const n_samples = hdr.column_labels.size() - 9;
-
-    /* caches */
-    size_t   record_no = -1; // always refers to #record in input even if more records are created
-    /* temporary record – do we need dynamic int-width?*/
-    record_t new_rec;
-    new_rec.alt = {".", "."};
-    new_rec.info.emplace_back("REFBIN_MAXLEN", int32_t{});
-    new_rec.info.emplace_back("ALTBIN_MINLEN", int32_t{});
-    new_rec.info.emplace_back("REFBIN_INDEXES", std::vector<int16_t>{});
-    new_rec.info.emplace_back("ALTBIN_INDEXES", std::vector<int16_t>{});
-    new_rec.genotypes.emplace_back("GT", std::vector<std::string>{});
-    using pl_t = bio::ranges::concatenated_sequences<std::vector<int16_t>>;
-    new_rec.genotypes.emplace_back("PL", pl_t{});
-
-    /* shortcuts into the variants */
-    int32_t &                  refbin_max     = std::get<int32_t>(new_rec.info[0].value);
-    int32_t &                  altbin_min     = std::get<int32_t>(new_rec.info[1].value);
-    std::vector<int16_t> &     refbin_indexes = std::get<std::vector<int16_t>>(new_rec.info[2].value);
-    std::vector<int16_t> &     altbin_indexes = std::get<std::vector<int16_t>>(new_rec.info[3].value);
-    std::vector<std::string> & out_GTs        = std::get<std::vector<std::string>>(new_rec.genotypes[0].value);
-    out_GTs.resize(n_samples);
+
+    std::optional<plink_writer> plink;
+    if (!opts.plink_prefix.empty())
+        plink.emplace(opts.plink_prefix, hdr);
+    std::string plink_ref;
 
     /* ========= define steps =========== */
+    size_t record_no = -1; // always refers to #record in input even if more records are created
 
-    /* pre */
-    auto pre_fn = [&](record_t & record) -> record_t &
+    auto transform_fn = [&](record_t & record) -> decovar::stage_generator<record_t &>
     {
         ++record_no;
-        return record;
-    };
-    auto pre_view = std::views::transform(pre_fn);
-
-    /* remove rare alleles */
-    auto bin_by_length_fn = [&](record_t & record) -> std::generator<record_t &>
-    {
-        size_t const n_alts    = record.alt.size();
-        size_t const n_alleles = n_alts + 1;
-
-        if (n_alts <= 1ul || !opts.bin_by_length /* || !record.genotypes.contains("GT")*/)
+        for (record_t & out : transform.process(std::span{&record, 1}, std::span<size_t const>{&record_no, 1}))
         {
-            co_yield record;
-            co_return;
-        }
-
-        /* this crap can go once we have dictionaries */
-        {
-            bool has_PL = false;
-            for (auto && [key, value] : record.genotypes)
-                if (key == "PL")
-                    has_PL = true;
-            if (!has_PL)
+            if (plink && !transform.plink_row().empty())
             {
-                co_yield record;
-                co_return;
+                if (out.alt.size() == 1ul) // biallelic input record
+                {
+                    plink_allele_string(out.ref, plink_ref);
+                    plink->write(out, plink_ref, out.alt[0], transform.plink_row());
+                }
+                else
+                {
+                    plink->write(out, "REFBIN", "ALTBIN", transform.plink_row());
+                }
             }
+            co_yield out;
         }
+    };
+    auto transform_view = std::views::transform(transform_fn) | decovar::views_cojoin;
 
-        //                   length, index
-        std::vector<std::pair<size_t, size_t>> allele_lengths;
-        allele_lengths.resize(n_alleles);
-        allele_lengths[0] = {record.ref.size(), 0};
-
-        auto lengths_v = allele_lengths | std::views::elements<0>;
-        std::ranges::copy(record.alt | std::views::transform(std::ranges::size), lengths_v.begin() + 1);
-
-        auto indexes_v = allele_lengths | std::views::elements<1>;
-        std::ranges::copy(std::views::iota(1ul, n_alleles), indexes_v.begin() + 1);
-
-        // fmt::print(stderr, "allele_lengths: {}\n", allele_lengths);
-        std::ranges::sort(allele_lengths);
-        // fmt::print(stderr, "allele_lengths (sorted): {}\n", allele_lengths);
-
-        new_rec.chrom = record.chrom;
-        new_rec.pos   = record.pos;
-
-        for (size_t i = 0; i < indexes_v.size() - 1; ++i)
-        {
-            refbin_max = lengths_v[i];
-            altbin_min = lengths_v[i + 1];
-
-            if (refbin_max == altbin_min && !opts.same_length_splits) // lengths shall not be present in both groups
-                continue;
-
-            if (record.id != ".")
-                new_rec.id = fmt::format("{}_div_{}", record.id, i);
-
-            refbin_indexes.clear();
-            std::ranges::copy(indexes_v | std::views::take(i + 1), std::back_inserter(refbin_indexes));
+    /* ========= create and execute pipeline =========== */
+    memory_budget budget{opts.max_memory << 20};
+    pin_thread_group(opts.affinity.reader);
+    read_ahead ahead{reader, budget};
+    pin_thread_group(opts.affinity.transform);
+    ahead.records() | transform_view | writer;
+}
 
-            altbin_indexes.clear();
-            std::ranges::copy(indexes_v | std::views::drop(i + 1), std::back_inserter(altbin_indexes));
+void main(sharg::parser & parser)
+{
+    program_options opts = parse_options(parser);
 
-            auto visitor = bio::meta::overloaded{
-              [](auto const &) { throw decovar_error{"PL field was in wrong state"}; },
-              [&]<typename int_t>(bio::ranges::concatenated_sequences<std::vector<int_t>> const & in_PLs)
-              {
-                  assert(n_samples == in_PLs.size());
-                  if (in_PLs.concat_size() != n_samples * (bio::io::var::detail::vcf_gt_formula(n_alts, n_alts) + 1))
-                  {
-                      throw decovar_error{
-                        "[Record no: {}] Currently, every sample must be diploid and must contain the "
-                        "full number of PL values (e.g. no single '.' placeholder allowed).",
-                        record_no};
-                  }
+    /* Several files are processed at the same time, each with its own share of the threads for reading and writing.
+     * The transform threads are pooled, so that files with expensive records can use the share of the others. */
+    size_t const n_files      = opts.input_files.size();
+    size_t const n_concurrent = concurrent_files(n_files, opts.threads);
+    size_t const file_threads = std::max<size_t>(2, opts.threads / n_concurrent);
 
-                  bio::ranges::concatenated_sequences<std::vector<int_t>> & out_PLs =
-                    establish_PLs<int_t>(new_rec.genotypes[1].value, n_samples);
+    pin_thread_group(opts.affinity.transform);
+    decovar::thread_pool pool{n_concurrent * io_threads(file_threads).pool};
 
-                  for (size_t j = 0; j < n_samples; ++j)
+    for_each_file(n_files,
+                  n_concurrent,
+                  [&](size_t const i)
                   {
-                      std::span<int_t const> const in_PL = in_PLs[j];
-                      assert(in_PL.size() == bio::io::var::detail::vcf_gt_formula(n_alts, n_alts) + 1);
-                      std::span<int_t> const out_PL = out_PLs[j];
-
-                      /* 0/0 value */
-                      out_PL[0] = std::numeric_limits<int_t>::max();
-                      for (size_t const b : refbin_indexes)
-                          for (size_t const a : refbin_indexes)
-                              if (a <= b)
-                                  out_PL[0] =
-                                    std::min<int_t>(out_PL[0], in_PL[bio::io::var::detail::vcf_gt_formula(a, b)]);
-
-                      /* 0/1 value */
-                      out_PL[1] = std::numeric_limits<int_t>::max();
-                      for (size_t const b : refbin_indexes)
-                          for (size_t const a : altbin_indexes)
-                              if (a <= b)
-                                  out_PL[1] =
-                                    std::min<int_t>(out_PL[1], in_PL[bio::io::var::detail::vcf_gt_formula(a, b)]);
-                      for (size_t const b : altbin_indexes)
-                          for (size_t const a : refbin_indexes)
-                              if (a <= b)
-                                  out_PL[1] =
-                                    std::min<int_t>(out_PL[1], in_PL[bio::io::var::detail::vcf_gt_formula(a, b)]);
-
-                      /* 1/1 value */
-                      out_PL[2] = std::numeric_limits<int_t>::max();
-                      for (size_t const b : altbin_indexes)
-                          for (size_t const a : altbin_indexes)
-                              if (a <= b)
-                                  out_PL[2] =
-                                    std::min<int_t>(out_PL[2], in_PL[bio::io::var::detail::vcf_gt_formula(a, b)]);
-
-                      switch (std::ranges::min_element(out_PL) - out_PL.begin())
-                      {
-                          case 0:
-                              out_GTs[j] = "0/0";
-                              break;
-                          case 1:
-                              out_GTs[j] = "0/1";
-                              break;
-                          case 2:
-                              out_GTs[j] = "1/1";
-                              break;
-                          default:
-                              BIOCPP_UNREACHABLE;
-                              break;
-                      }
-                  }
-              }};
-
-            for (auto && [key, value] : record.genotypes)
-                if (key == "PL")
-                    std::visit(visitor, value), ({ break; });
-
-            co_yield new_rec;
-        }
-    };
-    auto bin_by_length_view = std::views::transform(bin_by_length_fn) | views_cojoin;
-
-    /* ========= create and execute pipeline =========== */
-    reader | pre_view | bin_by_length_view | writer;
+                      program_options file_opts = opts;
+                      file_opts.input_file      = opts.input_files[i];
+                      file_opts.output_file     = expand_output_template(opts.output_file, file_opts.input_file);
+                      file_opts.plink_prefix    = expand_output_template(opts.plink_prefix, file_opts.input_file);
+                      if (opts.max_memory > 0)
+                          file_opts.max_memory = std::max<size_t>(1, opts.max_memory / n_concurrent);
+
+                      log(opts,
+                          "Processing {} → {}.\n",
+                          file_opts.input_file.string(),
+                          file_opts.output_file.string());
+                      binalleles_file(file_opts, file_threads, pool);
+                  });
 }
 
 } // namespace _binalleles
@@ -21,11 +21,15 @@
 // SOFTWARE.
 
 #include <cstddef>
-#include <thread>
+#include <filesystem>
 #include <variant>
+#include <vector>
 
 #include <sharg/all.hpp>
 
+#include "../cpus.hpp"
+#include "../decovar.hpp"
+
 #pragma once
 
 namespace _binalleles
@@ -33,16 +37,17 @@ namespace _binalleles
 
 void main(sharg::parser & sub_parser);
 
-struct program_options
+struct program_options : decovar::binalleles_options
 {
-    std::filesystem::path input_file;
-    std::filesystem::path output_file      = "-";
-    char                  output_file_type = 'a';
-
-    bool bin_by_length      = false;
-    bool same_length_splits = false;
-
-    size_t threads = std::max<size_t>(2, std::min<size_t>(8, std::thread::hardware_concurrency()));
+    std::vector<std::filesystem::path> input_files;
+    std::filesystem::path              input_file;             // the one of input_files being processed
+    std::filesystem::path              output_file      = "-"; // "{}" is replaced by the input's name
+    char                               output_file_type = 'a';
+    std::filesystem::path              plink_prefix;
+
+    size_t       threads    = std::max<size_t>(2, std::min<size_t>(8, available_cpus()));
+    size_t       max_memory = 0ul; // MiB; 0 → no limit
+    cpu_affinity affinity;         // empty → threads are not pinned
 
     bool verbose = false;
 };
@@ -0,0 +1,193 @@
+// MIT License
+//
+// Copyright (c) 2023 deCODE Genetics
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+#include <bio/alphabet/concept.hpp>
+#include <bio/io/var/header.hpp>
+
+#include "../misc.hpp"
+
+namespace _binalleles
+{
+
+/* 2-bit genotype codes of the PLINK 1 binary format; ALT is A1 and REF is A2 */
+enum plink_code : uint8_t
+{
+    hom_alt = 0b00,
+    missing = 0b01,
+    het     = 0b10,
+    hom_ref = 0b11,
+};
+
+/* number of bytes per variant */
+inline size_t plink_row_size(size_t const n_samples)
+{
+    return (n_samples + 3) / 4;
+}
+
+/* every byte holds four samples, the first one in the lowest bits */
+inline void plink_set_code(std::span<uint8_t> const row, size_t const j, plink_code const code)
+{
+    size_t const shift = (j % 4) * 2;
+    row[j / 4]         = static_cast<uint8_t>((row[j / 4] & ~(0b11 << shift)) | (code << shift));
+}
+
+/* A row where all samples have the same code. */
+inline void plink_fill_row(std::span<uint8_t> const row, plink_code const code)
+{
+    std::ranges::fill(row, static_cast<uint8_t>(code | code << 2 | code << 4 | code << 6));
+}
+
+/* Writes .bed, .bim and .fam files next to each other (SNP-major). Rows are packed by the caller. */
+class plink_writer
+{
+private:
+    struct string_hash
+    {
+        using is_transparent = void;
+        size_t operator()(std::string_view const str) const noexcept { return std::hash<std::string_view>{}(str); }
+    };
+
+    std::ofstream                                                 bed;
+    std::ofstream                                                 bim;
+    size_t                                                        row_size = 0;
+    std::unordered_set<std::string, string_hash, std::equal_to<>> ids; // written at the current position
+    std::string                                                   ids_chrom;
+    int64_t                                                       ids_pos = -1;
+    std::string                                                   id_buf;
+
+    /* PLINK requires unique variant IDs; missing and repeated IDs (e.g. of the records split from one record) are
+     * replaced by CHROM:POS:REF:ALT, with a counter appended if that is taken as well. Repeats are only looked for
+     * among the records at the same position, so that memory does not grow with the number of variants. */
+    std::string_view unique_id(record_t const & record, std::string_view const ref, std::string_view const alt)
+    {
+        if (record.pos != ids_pos || record.chrom != ids_chrom)
+        {
+            ids.clear();
+            ids_chrom = record.chrom;
+            ids_pos   = record.pos;
+        }
+
+        std::string_view id = record.id;
+        if (id.empty() || id == "." || ids.contains(id))
+        {
+            id_buf = fmt::format("{}:{}:{}:{}", record.chrom, record.pos, ref, alt);
+            for (size_t n = 2; ids.contains(id_buf); ++n)
+                id_buf = fmt::format("{}:{}:{}:{}:{}", record.chrom, record.pos, ref, alt, n);
+            id = id_buf;
+        }
+
+        ids.emplace(id);
+        return id;
+    }
+
+    static std::ofstream open(std::filesystem::path const & prefix, std::string_view const extension)
+    {
+        std::filesystem::path path = prefix;
+        path += extension;
+
+        std::ofstream stream{path, std::ios::binary};
+        if (!stream.is_open())
+            throw decovar_error{"Could not open '{}' for writing.", path.string()};
+        return stream;
+    }
+
+public:
+    plink_writer(std::filesystem::path const & prefix, bio::io::var::header const & hdr) :
+      bed{open(prefix, ".bed")}, bim{open(prefix, ".bim")}
+    {
+        size_t const n_samples = hdr.column_labels.size() - 9;
+        row_size               = plink_row_size(n_samples);
+
+        std::ofstream fam = open(prefix, ".fam");
+        for (size_t j = 9; j < hdr.column_labels.size(); ++j)
+            fam << hdr.column_labels[j] << ' ' << hdr.column_labels[j] << " 0 0 0 -9\n";
+
+        // magic number and SNP-major mode
+        bed.put(0x6c).put(0x1b).put(0x01);
+    }
+
+    /* appends one variant; ref and alt become A2 and A1 */
+    void write(record_t const &               record,
+               std::string_view const         ref,
+               std::string_view const         alt,
+               std::span<uint8_t const> const row)
+    {
+        assert(row.size() == row_size);
+
+        bim << record.chrom << '\t' << unique_id(record, ref, alt) << "\t0\t" << record.pos << '\t' << alt << '\t'
+            << ref << '\n';
+        bed.write(reinterpret_cast<char const *>(row.data()), row.size());
+
+        if (!bed || !bim)
+            throw decovar_error{"Writing the PLINK files failed."};
+    }
+};
+
+/* Packs a biallelic record's genotypes as decided by the smallest PL. */
+template <std::signed_integral int_t>
+void plink_pack_PLs(bio::ranges::concatenated_sequences<std::vector<int_t>> const & PLs,
+                    size_t const                                                    record_no,
+                    std::span<uint8_t> const                                        row)
+{
+    for (size_t j = 0; j < PLs.size(); ++j)
+    {
+        std::span<int_t const> const PL = PLs[j];
+        if (PL.size() != 3)
+        {
+            throw decovar_error{"[Record no: {}] PLINK output requires diploid samples with three PL values.",
+                                record_no};
+        }
+
+        auto const it = std::ranges::min_element(PL);
+        if (*it < bcf_int_lowest<int_t>) // missing
+            plink_set_code(row, j, missing);
+        else
+            plink_set_code(row, j, std::array{hom_ref, het, hom_alt}[it - PL.begin()]);
+    }
+}
+
+/* The reference allele as a string, independent of the record's alphabet. */
+inline void plink_allele_string(auto const & allele, std::string & out)
+{
+    out.clear();
+    for (auto const c : allele)
+        out.push_back(bio::alphabet::to_char(c));
+}
+
+} // namespace _binalleles
@@ -0,0 +1,568 @@
+// MIT License
+//
+// Copyright (c) 2023 deCODE Genetics
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <ranges>
+#include <span>
+#include <variant>
+#include <vector>
+
+#include <bio/io/exception.hpp>
+#include <bio/io/var/header.hpp>
+#include <bio/io/var/misc.hpp>
+#include <bio/io/var/record.hpp>
+#include <bio/ranges/to.hpp>
+#include <bio/ranges/views/zip.hpp>
+
+#include "../decovar.hpp"
+#include "../generator.hpp"
+#include "../misc.hpp"
+#include "../sparse_pl.hpp"
+#include "../thread_pool.hpp"
+#include "binalleles.hpp"
+#include "plink.hpp"
+
+namespace _binalleles
+{
+
+template <typename int_t>
+bio::ranges::concatenated_sequences<std::vector<int_t>> & establish_PLs(
+  bio::io::var::genotype_element_value_type<bio::io::ownership::deep> & variant,
+  size_t const                                                          n_samples)
+{
+    if (!std::holds_alternative<bio::ranges::concatenated_sequences<std::vector<int_t>>>(variant))
+    {
+        bio::ranges::concatenated_sequences<std::vector<int_t>> newGTs;
+        concatenated_sequences_create_scaffold(newGTs, n_samples, 3ul);
+        variant = std::move(newGTs);
+    }
+    return std::get<bio::ranges::concatenated_sequences<std::vector<int_t>>>(variant);
+}
+
+template <std::signed_integral int_t>
+std::vector<int_t> & establish_indexes(bio::io::var::info_element_value_type<bio::io::ownership::deep> & variant)
+{
+    if (!std::holds_alternative<std::vector<int_t>>(variant))
+        variant = std::vector<int_t>{};
+    return std::get<std::vector<int_t>>(variant);
+}
+
+/* indexes are bounded by n_alts, so they are stored at the narrowest width that holds n_alts */
+template <std::ranges::input_range rng_t>
+void assign_indexes(bio::io::var::info_element_value_type<bio::io::ownership::deep> & variant,
+                    rng_t &&                                                         indexes,
+                    size_t const                                                     n_alts)
+{
+    auto fn = [&]<std::signed_integral int_t>(std::type_identity<int_t>)
+    {
+        std::vector<int_t> & vec = establish_indexes<int_t>(variant);
+        vec.clear();
+        for (size_t const i : indexes)
+            vec.push_back(static_cast<int_t>(i));
+    };
+
+    visit_narrowest_int(0, n_alts, fn);
+}
+
+/* the record that all created records are copied from */
+record_t create_template_record(size_t const n_samples)
+{
+    record_t new_rec;
+    new_rec.alt = {".", "."};
+    new_rec.info.emplace_back("REFBIN_MAXLEN", int32_t{});
+    new_rec.info.emplace_back("ALTBIN_MINLEN", int32_t{});
+    new_rec.info.emplace_back("REFBIN_INDEXES", std::vector<int8_t>{});
+    new_rec.info.emplace_back("ALTBIN_INDEXES", std::vector<int8_t>{});
+    new_rec.genotypes.emplace_back("GT", std::vector<std::string>(n_samples));
+    using pl_t = bio::ranges::concatenated_sequences<std::vector<int16_t>>;
+    new_rec.genotypes.emplace_back("PL", pl_t{});
+    return new_rec;
+}
+
+/* With capped PLs, every confidently homozygous REF sample (PL(0/0) == 0 and all other PLs >= cap) has the same PL
+ * and GT in every created record. Only the other samples ("carriers") need to be binned. */
+template <std::signed_integral int_t>
+void determine_carriers(bio::ranges::concatenated_sequences<std::vector<int_t>> const & in_PLs,
+                        decovar::binalleles_options const &                             opts,
+                        std::vector<size_t> &                                           carriers)
+{
+    carriers.clear();
+
+    if (opts.pl_cap == 0)
+    {
+        for (size_t j = 0; j < in_PLs.size(); ++j)
+            carriers.push_back(j);
+        return;
+    }
+
+    int_t const cap = effective_pl_cap<int_t>(opts.pl_cap);
+    for (size_t j = 0; j < in_PLs.size(); ++j)
+    {
+        std::span<int_t const> const in_PL = in_PLs[j];
+        if (in_PL.empty() || in_PL[0] != 0 ||
+            !std::ranges::all_of(in_PL.subspan(1), [cap](int_t const PL) { return PL >= cap; }))
+            carriers.push_back(j);
+    }
+}
+
+/* as above for records whose PLs are stored sparsely */
+void determine_carriers(sparse_PLs const & in_PLs, std::vector<size_t> & carriers)
+{
+    carriers.clear();
+
+    for (size_t j = 0; j < in_PLs.size(); ++j)
+    {
+        std::span<sparse_PLs::entry_t const> const in_PL = in_PLs[j];
+        if (in_PL.size() != 1 || in_PL[0].a != 0 || in_PL[0].b != 0 || in_PL[0].value != 0)
+            carriers.push_back(j);
+    }
+}
+
+/* Creates the record for the split after the i-th shortest allele. Only reads record and only writes out, so
+ * different splits can be computed concurrently. */
+void bin_split(record_t const &                                 record,
+               size_t const                                     record_no,
+               std::span<std::pair<size_t, size_t> const> const allele_lengths, // sorted (length, index)
+               size_t const                                     i,
+               std::span<size_t const> const                    carriers,
+               sparse_PLs const * const                         sparse, // nullptr → use the record's PLs
+               size_t const                                     n_samples,
+               decovar::binalleles_options const &              opts,
+               record_t &                                       out,
+               std::span<uint8_t> const                         plink_row) // empty if no PLINK output
+{
+    size_t const n_alts = record.alt.size();
+
+    auto lengths_v = allele_lengths | std::views::elements<0>;
+    auto indexes_v = allele_lengths | std::views::elements<1>;
+
+    out.chrom = record.chrom;
+    out.pos   = record.pos;
+    out.id    = record.id == "." ? record.id : fmt::format("{}_div_{}", record.id, i);
+
+    std::get<int32_t>(out.info[0].value) = lengths_v[i];     // REFBIN_MAXLEN
+    std::get<int32_t>(out.info[1].value) = lengths_v[i + 1]; // ALTBIN_MINLEN
+
+    auto refbin_indexes = indexes_v | std::views::take(i + 1);
+    auto altbin_indexes = indexes_v | std::views::drop(i + 1);
+
+    assign_indexes(out.info[2].value, refbin_indexes, n_alts);
+    assign_indexes(out.info[3].value, altbin_indexes, n_alts);
+
+    std::vector<std::string> & out_GTs = std::get<std::vector<std::string>>(out.genotypes[0].value);
+
+    auto visitor = bio::meta::overloaded{
+      [](auto const &) { throw decovar_error{"PL field was in wrong state"}; },
+      [&]<std::signed_integral int_t>(bio::ranges::concatenated_sequences<std::vector<int_t>> const & in_PLs)
+      {
+          assert(n_samples == in_PLs.size());
+          if (in_PLs.concat_size() != n_samples * (bio::io::var::detail::vcf_gt_formula(n_alts, n_alts) + 1))
+          {
+              throw decovar_error{
+                "[Record no: {}] Currently, every sample must be diploid and must contain the "
+                "full number of PL values (e.g. no single '.' placeholder allowed).",
+                record_no};
+          }
+
+          int_t const cap = effective_pl_cap<int_t>(opts.pl_cap);
+
+          std::vector<uint8_t> in_altbin; // per allele: 1 if it is in ALTBIN
+          if (sparse != nullptr)
+          {
+              in_altbin.resize(n_alts + 1);
+              for (size_t const a : altbin_indexes)
+                  in_altbin[a] = 1;
+          }
+
+          // capped PLs may fit into a narrower type than the input PLs
+          auto bin = [&]<std::signed_integral out_t>(std::type_identity<out_t>)
+          {
+              bio::ranges::concatenated_sequences<std::vector<out_t>> & out_PLs =
+                establish_PLs<out_t>(out.genotypes[1].value, n_samples);
+
+              /* confident REF samples; the REF allele may be in either bin */
+              if (opts.pl_cap > 0)
+              {
+                  bool const  ref_in_refbin = std::ranges::find(refbin_indexes, 0ul) != refbin_indexes.end();
+                  out_t const capped        = convert_int_value<out_t>(cap);
+
+                  std::array<out_t, 3> const PL_template =
+                    ref_in_refbin ? std::array<out_t, 3>{0, capped, capped} : std::array<out_t, 3>{capped, capped, 0};
+
+                  std::string_view const GT_template = ref_in_refbin ? "0/0" : "1/1";
+
+                  for (size_t j = 0; j < n_samples; ++j)
+                  {
+                      std::ranges::copy(PL_template, out_PLs[j].begin());
+                      out_GTs[j] = GT_template;
+                  }
+
+                  plink_fill_row(plink_row, ref_in_refbin ? hom_ref : hom_alt);
+              }
+
+              for (size_t const j : carriers)
+              {
+                  std::span<out_t> const out_PL = out_PLs[j];
+
+                  std::array<int_t, 3> PL{std::numeric_limits<int_t>::max(),
+                                          std::numeric_limits<int_t>::max(),
+                                          std::numeric_limits<int_t>::max()};
+
+                  if (sparse != nullptr)
+                  {
+                      // capped genotypes are not stored
+                      PL.fill(cap);
+                      for (sparse_PLs::entry_t const & e : (*sparse)[j])
+                      {
+                          size_t const k = in_altbin[e.a] + in_altbin[e.b]; // 0/0, 0/1 or 1/1
+                          PL[k]          = std::min(PL[k], convert_int_value<int_t>(e.value));
+                      }
+                  }
+                  else
+                  {
+                      std::span<int_t const> const in_PL = in_PLs[j];
+                      assert(in_PL.size() == bio::io::var::detail::vcf_gt_formula(n_alts, n_alts) + 1);
+
+                      /* 0/0 value */
+                      for (size_t const b : refbin_indexes)
+                          for (size_t const a : refbin_indexes)
+                              if (a <= b)
+                                  PL[0] = std::min<int_t>(PL[0], in_PL[bio::io::var::detail::vcf_gt_formula(a, b)]);
+
+                      /* 0/1 value */
+                      for (size_t const b : refbin_indexes)
+                          for (size_t const a : altbin_indexes)
+                              if (a <= b)
+                                  PL[1] = std::min<int_t>(PL[1], in_PL[bio::io::var::detail::vcf_gt_formula(a, b)]);
+                      for (size_t const b : altbin_indexes)
+                          for (size_t const a : refbin_indexes)
+                              if (a <= b)
+                                  PL[1] = std::min<int_t>(PL[1], in_PL[bio::io::var::detail::vcf_gt_formula(a, b)]);
+
+                      /* 1/1 value */
+                      for (size_t const b : altbin_indexes)
+                          for (size_t const a : altbin_indexes)
+                              if (a <= b)
+                                  PL[2] = std::min<int_t>(PL[2], in_PL[bio::io::var::detail::vcf_gt_formula(a, b)]);
+                  }
+
+                  for (size_t k = 0; k < 3; ++k)
+                      out_PL[k] = convert_int_value<out_t>(std::min<int_t>(PL[k], cap));
+
+                  // GT is decided on the uncapped values (as far as they are stored)
+                  size_t const argmin = std::ranges::min_element(PL) - PL.begin();
+                  switch (argmin)
+                  {
+                      case 0:
+                          out_GTs[j] = "0/0";
+                          break;
+                      case 1:
+                          out_GTs[j] = "0/1";
+                          break;
+                      case 2:
+                          out_GTs[j] = "1/1";
+                          break;
+                      default:
+                          BIOCPP_UNREACHABLE;
+                          break;
+                  }
+
+                  if (!plink_row.empty())
+                  {
+                      plink_set_code(plink_row,
+                                     j,
+                                     PL[argmin] < bcf_int_lowest<int_t> ? missing
+                                                                        : std::array{hom_ref, het, hom_alt}[argmin]);
+                  }
+              }
+          };
+
+          visit_narrowest_int(0, cap, bin);
+      }};
+
+    for (auto && [key, value] : record.genotypes)
+        if (key == "PL")
+            std::visit(visitor, value), ({ break; });
+}
+
+} // namespace _binalleles
+
+namespace decovar
+{
+
+struct binalleles_transform::impl
+{
+    binalleles_options const opts;
+    header_t                 hdr;
+    size_t                   n_samples = 0;
+    thread_pool &            pool;
+    size_t const             max_out_recs; // bounds the memory held by created records
+    bool const               plink;
+
+    /* caches */
+    record_t                               template_rec;
+    std::vector<record_t>                  out_recs;
+    std::vector<std::pair<size_t, size_t>> allele_lengths; // length, index
+    std::vector<size_t>                    splits;
+    std::vector<size_t>                    carriers;
+    sparse_PLs                             sparse;
+    bool                                   use_sparse = false;
+    std::vector<std::vector<uint8_t>>      plink_rows;
+    std::span<uint8_t const>               plink_row; // of the record yielded last
+
+    impl(binalleles_options const & opts, header_t const & input_header, thread_pool & pool) :
+      opts{opts},
+      hdr{input_header},
+      pool{pool},
+      max_out_recs{pool.size() + 1},
+      plink{opts.plink_rows}
+    {
+        if (opts.bin_by_length) // the header is rewritten
+        {
+            hdr.infos.clear();
+            bio::io::var::header::format_t ref{
+              .id          = "REFBIN_INDEXES",
+              .number      = bio::io::var::header_number::dot,
+              .type        = "Integer",
+              .type_id     = bio::io::var::value_type_id::vector_of_int32, // actual width is chosen per record
+              .description = "Indexes of original alleles binned as the reference.",
+            };
+            hdr.infos.push_back(std::move(ref));
+
+            bio::io::var::header::format_t ref_max{
+              .id          = "REFBIN_MAXLEN",
+              .number      = 1,
+              .type        = "Integer",
+              .type_id     = bio::io::var::value_type_id::int32,
+              .description = "Maximum allele length in REFBIN.",
+            };
+            hdr.infos.push_back(std::move(ref_max));
+
+            bio::io::var::header::format_t alt{
+              .id          = "ALTBIN_INDEXES",
+              .number      = bio::io::var::header_number::dot,
+              .type        = "Integer",
+              .type_id     = bio::io::var::value_type_id::vector_of_int32, // actual width is chosen per record
+              .description = "Indexes of original alleles binned as the ALT.",
+            };
+            hdr.infos.push_back(std::move(alt));
+
+            bio::io::var::header::format_t alt_min{
+              .id          = "ALTBIN_MINLEN",
+              .number      = 1,
+              .type        = "Integer",
+              .type_id     = bio::io::var::value_type_id::int32,
+              .description = "Minimum allale length in ALTBIN.",
+            };
+            hdr.infos.push_back(std::move(alt_min));
+
+            hdr.formats.clear();
+            hdr.formats.push_back(bio::io::var::reserved_formats.at("GT"));
+            hdr.formats.push_back(bio::io::var::reserved_formats.at("PL"));
+
+            hdr.add_missing();
+        }
+
+        if (hdr.column_labels.size() < 10)
+            throw decovar_error{"VCF file contains no samples."};
+        n_samples    = hdr.column_labels.size() - 9;
+        template_rec = _binalleles::create_template_record(n_samples);
+    }
+
+    /* records that are biallelic already are exported to PLINK as-is */
+    void plink_biallelic(record_t const & record, size_t const record_no)
+    {
+        if (!plink || record.alt.size() != 1ul)
+            return;
+
+        for (auto && [key, value] : record.genotypes)
+        {
+            if (key == "PL")
+            {
+                plink_rows.resize(std::max<size_t>(plink_rows.size(), 1ul));
+                plink_rows[0].resize(plink_row_size(n_samples));
+
+                auto visitor = bio::meta::overloaded{
+                  [&]<std::signed_integral int_t>(bio::ranges::concatenated_sequences<std::vector<int_t>> const & PLs)
+                  { plink_pack_PLs(PLs, record_no, plink_rows[0]); },
+                  [](auto const &) { throw decovar_error{"PL field was in wrong state"}; }};
+                std::visit(visitor, value);
+
+                plink_row = plink_rows[0];
+                break;
+            }
+        }
+    }
+
+    /* bins the alleles of a record; records that need no binning are yielded as-is */
+    stage_generator<record_t &> bin_by_length(record_t & record, size_t const record_no)
+    {
+        size_t const n_alts    = record.alt.size();
+        size_t const n_alleles = n_alts + 1;
+
+        plink_row = {};
+
+        if (n_alts <= 1ul || !opts.bin_by_length /* || !record.genotypes.contains("GT")*/)
+        {
+            plink_biallelic(record, record_no);
+            co_yield record;
+            co_return;
+        }
+
+        /* this crap can go once we have dictionaries */
+        {
+            bool has_PL = false;
+            for (auto && [key, value] : record.genotypes)
+                if (key == "PL")
+                    has_PL = true;
+            if (!has_PL)
+            {
+                co_yield record;
+                co_return;
+            }
+        }
+
+        allele_lengths.resize(n_alleles);
+        allele_lengths[0] = {record.ref.size(), 0};
+
+        auto lengths_v = allele_lengths | std::views::elements<0>;
+        std::ranges::copy(record.alt | std::views::transform(std::ranges::size), lengths_v.begin() + 1);
+
+        auto indexes_v = allele_lengths | std::views::elements<1>;
+        std::ranges::copy(std::views::iota(1ul, n_alleles), indexes_v.begin() + 1);
+
+        std::ranges::sort(allele_lengths);
+
+        splits.clear();
+        for (size_t i = 0; i < n_alleles - 1; ++i)
+            if (lengths_v[i] != lengths_v[i + 1] || opts.same_length_splits) // lengths shall not be in both groups
+                splits.push_back(i);
+
+        for (auto && [key, value] : record.genotypes)
+        {
+            if (key == "PL")
+            {
+                auto visitor = bio::meta::overloaded{
+                  [&]<std::signed_integral int_t>(bio::ranges::concatenated_sequences<std::vector<int_t>> const & PLs)
+                  {
+                      /* with many alleles, almost all PLs are capped and only the others need to be visited */
+                      use_sparse = opts.pl_cap > 0 && PLs.concat_size() / n_samples >= sparse_PL_min_genotypes;
+                      if (use_sparse)
+                      {
+                          sparse.assign(PLs, n_alts, effective_pl_cap<int_t>(opts.pl_cap));
+                          _binalleles::determine_carriers(sparse, carriers);
+                      }
+                      else
+                      {
+                          _binalleles::determine_carriers(PLs, opts, carriers);
+                      }
+                  },
+                  [](auto const &) { throw decovar_error{"PL field was in wrong state"}; }};
+
+                std::visit(visitor, value);
+                break;
+            }
+        }
+
+        // small records are not worth the synchronisation
+        size_t const n_values = n_samples * (bio::io::var::detail::vcf_gt_formula(n_alts, n_alts) + 1);
+        size_t const chunk    = n_values * splits.size() >= (1ul << 16) ? max_out_recs : 1ul;
+
+        while (out_recs.size() < std::min(chunk, splits.size()))
+            out_recs.push_back(template_rec);
+
+        if (plink)
+        {
+            plink_rows.resize(std::max(plink_rows.size(), out_recs.size()));
+            for (std::vector<uint8_t> & row : plink_rows)
+                row.resize(plink_row_size(n_samples));
+        }
+
+        for (size_t begin = 0; begin < splits.size(); begin += chunk)
+        {
+            size_t const n = std::min(chunk, splits.size() - begin);
+
+            pool.parallel_for(n,
+                              [&](size_t const k)
+                              {
+                                  _binalleles::bin_split(record,
+                                                         record_no,
+                                                         allele_lengths,
+                                                         splits[begin + k],
+                                                         carriers,
+                                                         use_sparse ? &sparse : nullptr,
+                                                         n_samples,
+                                                         opts,
+                                                         out_recs[k],
+                                                         plink ? std::span<uint8_t>{plink_rows[k]}
+                                                               : std::span<uint8_t>{});
+                              });
+
+            for (size_t k = 0; k < n; ++k)
+            {
+                if (plink)
+                    plink_row = plink_rows[k];
+                co_yield out_recs[k];
+            }
+        }
+    }
+
+    stage_generator<record_t &> process(std::span<record_t> const records, std::span<size_t const> const record_nos)
+    {
+        for (size_t i = 0; i < records.size(); ++i)
+            for (record_t & out : bin_by_length(records[i], record_nos[i]))
+                co_yield out;
+    }
+};
+
+binalleles_transform::binalleles_transform(binalleles_options const & opts,
+                                           header_t const &           input_header,
+                                           thread_pool &              pool) :
+  pimpl{std::make_unique<impl>(opts, input_header, pool)}
+{}
+
+binalleles_transform::binalleles_transform(binalleles_transform &&) noexcept             = default;
+binalleles_transform & binalleles_transform::operator=(binalleles_transform &&) noexcept = default;
+binalleles_transform::~binalleles_transform()                                            = default;
+
+header_t const & binalleles_transform::header() const noexcept
+{
+    return pimpl->hdr;
+}
+
+stage_generator<record_t &> binalleles_transform::process(std::span<record_t> const     records,
+                                                          std::span<size_t const> const record_nos)
+{
+    return pimpl->process(records, record_nos);
+}
+
+std::span<uint8_t const> binalleles_transform::plink_row() const noexcept
+{
+    return pimpl->plink_row;
+}
+
+} // namespace decovar
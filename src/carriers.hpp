@@ -0,0 +1,249 @@
+// MIT License
+//
+// Copyright (c) 2023 deCODE Genetics
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include <bio/meta/overloaded.hpp>
+
+#include "misc.hpp"
+
+/* Writes a run-length encoded bitmap of which samples carry which ALT allele, so that carriers can be looked up
+ * without decoding the genotypes.
+ *
+ * An allele is carried by a sample if it is part of the sample's called genotype: the GT or, for records without GT,
+ * the genotype with the smallest LPL (mapped to global alleles through LAA) or PL. Being listed in LAA is no evidence
+ * by itself; LAA also lists alleles that a sample merely cannot rule out, and pseudo-localised records list all of
+ * them. FILE contains for every record: the number of ALT alleles and, per ALT allele, the number of runs
+ * followed by (first sample, number of samples) per run. All values are uint32. FILE.idx contains the uint64 byte
+ * offset of every record in FILE. All data is in native byte order.
+ */
+class carrier_index_writer
+{
+private:
+    std::ofstream data_stream;
+    std::ofstream index_stream;
+    uint64_t      offset = 0;
+
+    std::vector<std::vector<uint32_t>>                        carriers; // per ALT allele, ascending sample indexes
+    std::vector<uint32_t>                                     buffer;   // encoded record
+    bio::ranges::concatenated_sequences<std::vector<int32_t>> LAA_buf;
+
+    static std::ofstream open(std::filesystem::path const & path)
+    {
+        std::ofstream stream{path, std::ios::binary};
+        if (!stream.is_open())
+            throw decovar_error{"Could not open '{}' for writing.", path.string()};
+        return stream;
+    }
+
+    using field_t = std::remove_cvref_t<decltype(std::declval<record_t>().genotypes[0].value)>;
+
+    /* the value of the record's FORMAT field, or nullptr */
+    static field_t const * find_field(record_t const & record, std::string_view const id)
+    {
+        for (auto const & field : record.genotypes)
+            if (field.id == id)
+                return &field.value;
+        return nullptr;
+    }
+
+    void add(size_t const allele, size_t const sample)
+    {
+        if (allele == 0 || allele > carriers.size())
+            return;
+
+        std::vector<uint32_t> & samples = carriers[allele - 1];
+        if (samples.empty() || samples.back() != sample) // GTs like 1/1 name the allele twice
+            samples.push_back(sample);
+    }
+
+    void collect_from_GT(std::vector<std::string> const & GTs)
+    {
+        for (size_t j = 0; j < GTs.size(); ++j)
+        {
+            std::string_view const GT = GTs[j];
+
+            for (size_t b = 0; b < GT.size();)
+            {
+                size_t e = b;
+                while (e < GT.size() && GT[e] != '/' && GT[e] != '|')
+                    ++e;
+
+                size_t allele  = 0;
+                auto [ptr, ec] = std::from_chars(GT.data() + b, GT.data() + e, allele);
+                if (ec == std::errc{} && ptr == GT.data() + e) // skips '.'
+                    add(allele, j);
+
+                b = e + 1;
+            }
+        }
+    }
+
+    /* the alleles a <= b of the diploid genotype with the given index in VCF order */
+    static std::pair<size_t, size_t> genotype_alleles(size_t const index)
+    {
+        size_t b = (std::sqrt(8.0 * index + 1) - 1) / 2;
+        while (b * (b + 1) / 2 > index)
+            --b;
+        while ((b + 1) * (b + 2) / 2 <= index)
+            ++b;
+        return {index - b * (b + 1) / 2, b};
+    }
+
+    /* The genotype with the smallest PL; local alleles are mapped through LAAs (nullptr → PLs are global). Samples
+     * with as many PLs as alleles are haploid. */
+    template <std::signed_integral int_t>
+    void collect_from_PL(bio::ranges::concatenated_sequences<std::vector<int_t>> const &         PLs,
+                         bio::ranges::concatenated_sequences<std::vector<int32_t>> const * const LAAs,
+                         size_t const                                                            n_alts)
+    {
+        int_t const end_of_vector = std::numeric_limits<int_t>::min() + 1;
+
+        for (size_t j = 0; j < PLs.size(); ++j)
+        {
+            std::span<int_t const> PL = PLs[j];
+            while (!PL.empty() && PL.back() == end_of_vector)
+                PL = PL.first(PL.size() - 1);
+
+            size_t best = PL.size();
+            for (size_t k = 0; k < PL.size(); ++k)
+                if (PL[k] >= bcf_int_lowest<int_t> && (best == PL.size() || PL[k] < PL[best]))
+                    best = k;
+            if (best == PL.size()) // missing
+                continue;
+
+            std::span<int32_t const> const LAA       = LAAs ? (*LAAs)[j] : std::span<int32_t const>{};
+            size_t const                   n_alleles = LAAs ? LAA.size() + 1 : n_alts + 1;
+            auto const [a, b] = PL.size() == n_alleles ? std::pair{best, best} : genotype_alleles(best);
+
+            for (size_t const allele : {a, b})
+            {
+                if (LAAs == nullptr || allele == 0)
+                    add(allele, j);
+                else if (allele <= LAA.size() && LAA[allele - 1] > 0)
+                    add(LAA[allele - 1], j);
+            }
+        }
+    }
+
+public:
+    explicit carrier_index_writer(std::filesystem::path const & path) : data_stream{open(path)}
+    {
+        std::filesystem::path index_path = path;
+        index_path += ".idx";
+        index_stream = open(index_path);
+    }
+
+    void push_back(record_t const & record, size_t const record_no)
+    {
+        size_t const n_alts = record.alt.size();
+
+        carriers.resize(std::max(carriers.size(), n_alts));
+        for (std::vector<uint32_t> & samples : carriers)
+            samples.clear();
+        carriers.resize(n_alts);
+
+        auto const * GT  = find_field(record, "GT");
+        auto const * LPL = find_field(record, "LPL");
+        auto const * LAA = find_field(record, "LAA");
+        auto const * PL  = find_field(record, "PL");
+
+        auto GT_visitor = bio::meta::overloaded{
+          [&](std::vector<std::string> const & GTs) { collect_from_GT(GTs); },
+          [&](auto const &) { throw decovar_error{"[Record no: {}] GT field was in wrong state.", record_no}; }};
+
+        auto LAA_visitor = bio::meta::overloaded{
+          [&]<std::signed_integral int_t>(bio::ranges::concatenated_sequences<std::vector<int_t>> const & LAAs)
+          { concatenated_sequences_convert(LAAs, LAA_buf); },
+          [&](auto const &) { throw decovar_error{"[Record no: {}] LAA field was in wrong state.", record_no}; }};
+
+        auto PL_visitor = [&](bio::ranges::concatenated_sequences<std::vector<int32_t>> const * const LAAs)
+        {
+            return bio::meta::overloaded{
+              [&, LAAs]<std::signed_integral int_t>(bio::ranges::concatenated_sequences<std::vector<int_t>> const & PLs)
+              { collect_from_PL(PLs, LAAs, n_alts); },
+              [&](auto const &) { throw decovar_error{"[Record no: {}] PL field was in wrong state.", record_no}; }};
+        };
+
+        if (GT)
+        {
+            std::visit(GT_visitor, *GT);
+        }
+        else if (LPL && LAA)
+        {
+            std::visit(LAA_visitor, *LAA);
+            std::visit(PL_visitor(&LAA_buf), *LPL);
+        }
+        else if (PL)
+        {
+            std::visit(PL_visitor(nullptr), *PL);
+        }
+
+        /* encode */
+        buffer.clear();
+        buffer.push_back(n_alts);
+        for (std::vector<uint32_t> const & samples : carriers)
+        {
+            size_t const n_runs_pos = buffer.size();
+            buffer.push_back(0);
+
+            for (size_t i = 0; i < samples.size(); ++i)
+            {
+                if (i > 0 && samples[i] == samples[i - 1] + 1)
+                {
+                    ++buffer.back();
+                }
+                else
+                {
+                    buffer.push_back(samples[i]);
+                    buffer.push_back(1);
+                    ++buffer[n_runs_pos];
+                }
+            }
+        }
+
+        index_stream.write(reinterpret_cast<char const *>(&offset), sizeof(offset));
+        data_stream.write(reinterpret_cast<char const *>(buffer.data()), buffer.size() * sizeof(uint32_t));
+        offset += buffer.size() * sizeof(uint32_t);
+
+        if (!data_stream || !index_stream)
+            throw decovar_error{"Writing the carrier index failed."};
+    }
+};
@@ -0,0 +1,253 @@
+// MIT License
+//
+// Copyright (c) 2023 deCODE Genetics
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+#include <bio/io/var/header.hpp>
+#include <bio/meta/overloaded.hpp>
+
+#include "misc.hpp"
+
+/* Writes integer FORMAT fields as raw arrays that can be memory-mapped, e.g. with numpy.memmap.
+ *
+ * For every field, PREFIX.FIELD.values contains one chunk per batch of records: all values of the batch in record
+ * order and sample-major order within a record. Missing values keep their BCF representation (the smallest values of
+ * the type). PREFIX.FIELD.offsets contains n_records + 1 uint64 value offsets per batch, relative to the chunk.
+ * Every batch is stored at the narrowest integer width that holds its values; PREFIX.schema.tsv lists the batches
+ * with their type and byte offsets. All data is in native byte order.
+ */
+class columnar_writer
+{
+public:
+    static constexpr size_t batch_size = 1024; // records
+
+private:
+    struct column_t
+    {
+        std::string name;
+
+        std::ofstream values_stream;
+        std::ofstream offsets_stream;
+        size_t        values_bytes  = 0;
+        size_t        offsets_bytes = 0;
+
+        /* the current batch; values are kept at the width of the record's field and converted once on flushing */
+        std::vector<std::byte> values;
+        std::vector<uint8_t>   widths; // bytes per value, per record; 0 if the record has no values
+        std::vector<uint64_t>  offsets{0};
+        int64_t                min = 0;
+        int64_t                max = 0;
+    };
+
+    std::vector<column_t> columns;
+    std::ofstream         schema;
+    size_t                first_record = 0; // of the current batch
+    size_t                n_records    = 0; // in the current batch
+
+    static std::ofstream open(std::filesystem::path const & prefix, std::string_view const extension)
+    {
+        std::filesystem::path path = prefix;
+        path += extension;
+
+        std::ofstream stream{path, std::ios::binary};
+        if (!stream.is_open())
+            throw decovar_error{"Could not open '{}' for writing.", path.string()};
+        return stream;
+    }
+
+    template <std::signed_integral in_t, std::signed_integral out_t>
+    static void convert_values(std::byte const * in, size_t const n, out_t * out)
+    {
+        for (size_t i = 0; i < n; ++i, in += sizeof(in_t))
+        {
+            in_t v;
+            std::memcpy(&v, in, sizeof(in_t));
+            out[i] = convert_int_value<out_t>(v);
+        }
+    }
+
+    template <std::signed_integral out_t>
+    void flush_column(column_t & col)
+    {
+        size_t const n_values = col.offsets.back();
+
+        /* usually all records of a batch have the field at the output width already */
+        if (std::ranges::all_of(col.widths, [](uint8_t const w) { return w == 0 || w == sizeof(out_t); }))
+        {
+            col.values_stream.write(reinterpret_cast<char const *>(col.values.data()), col.values.size());
+        }
+        else
+        {
+            std::vector<out_t> out(n_values);
+            std::byte const *  in = col.values.data();
+            for (size_t i = 0; i < col.widths.size(); ++i)
+            {
+                size_t const n   = col.offsets[i + 1] - col.offsets[i];
+                out_t *      dst = out.data() + col.offsets[i];
+                switch (col.widths[i])
+                {
+                    case 1:
+                        convert_values<int8_t>(in, n, dst);
+                        break;
+                    case 2:
+                        convert_values<int16_t>(in, n, dst);
+                        break;
+                    case 4:
+                        convert_values<int32_t>(in, n, dst);
+                        break;
+                    default:
+                        convert_values<int64_t>(in, n, dst);
+                        break;
+                }
+                in += n * col.widths[i];
+            }
+            col.values_stream.write(reinterpret_cast<char const *>(out.data()), out.size() * sizeof(out_t));
+        }
+        col.offsets_stream.write(reinterpret_cast<char const *>(col.offsets.data()),
+                                 col.offsets.size() * sizeof(uint64_t));
+
+        schema << col.name << '\t' << first_record << '\t' << n_records << "\tint" << sizeof(out_t) * 8 << '\t'
+               << col.values_bytes << '\t' << n_values << '\t' << col.offsets_bytes << '\n';
+
+        col.values_bytes += n_values * sizeof(out_t);
+        col.offsets_bytes += col.offsets.size() * sizeof(uint64_t);
+    }
+
+    void flush()
+    {
+        if (n_records == 0)
+            return;
+
+        for (column_t & col : columns)
+        {
+            auto fn = [&]<std::signed_integral out_t>(std::type_identity<out_t>) { flush_column<out_t>(col); };
+            visit_narrowest_int(col.min, col.max, fn);
+
+            col.values.clear();
+            col.widths.clear();
+            col.offsets.assign(1, 0);
+            col.min = 0;
+            col.max = 0;
+        }
+
+        if (!schema)
+            throw decovar_error{"Writing the columnar output failed."};
+
+        first_record += n_records;
+        n_records = 0;
+    }
+
+public:
+    columnar_writer(std::filesystem::path const &      prefix,
+                    std::span<std::string const> const fields,
+                    bio::io::var::header const &       hdr) :
+      schema{open(prefix, ".schema.tsv")}
+    {
+        schema << "#samples";
+        for (size_t j = 9; j < hdr.column_labels.size(); ++j)
+            schema << '\t' << hdr.column_labels[j];
+        schema << "\n#field\tfirst_record\tn_records\ttype\tvalues_offset\tn_values\toffsets_offset\n";
+
+        columns.resize(fields.size());
+        for (size_t i = 0; i < fields.size(); ++i)
+        {
+            columns[i].name           = fields[i];
+            columns[i].values_stream  = open(prefix, "." + fields[i] + ".values");
+            columns[i].offsets_stream = open(prefix, "." + fields[i] + ".offsets");
+        }
+    }
+
+    columnar_writer(columnar_writer const &)             = delete;
+    columnar_writer & operator=(columnar_writer const &) = delete;
+
+    /* appends the record; fields that are not present in the record get no values */
+    void push_back(record_t const & record, size_t const record_no)
+    {
+        for (column_t & col : columns)
+        {
+            size_t const first_byte = col.values.size();
+            uint8_t      width      = 0; // no values
+            auto         visitor    = bio::meta::overloaded{
+              [&]<std::signed_integral int_t>(bio::ranges::concatenated_sequences<std::vector<int_t>> const & field)
+              {
+                  std::span<int_t const> const data = field.raw_data().first;
+
+                  auto [min, max] = regular_value_range<int_t>(data);
+                  col.min         = std::min(col.min, min);
+                  col.max         = std::max(col.max, max);
+
+                  std::byte const * bytes = reinterpret_cast<std::byte const *>(data.data());
+                  col.values.insert(col.values.end(), bytes, bytes + data.size_bytes());
+                  width = sizeof(int_t);
+              },
+              [&](auto const &)
+              {
+                  throw decovar_error{"[Record no: {}] Only integer FORMAT fields can be exported, but {} is not.",
+                                      record_no,
+                                      col.name};
+              }};
+
+            for (auto && [key, value] : record.genotypes)
+            {
+                if (key == col.name)
+                {
+                    std::visit(visitor, value);
+                    break;
+                }
+            }
+
+            col.widths.push_back(width);
+            col.offsets.push_back(col.offsets.back() + (width == 0 ? 0 : (col.values.size() - first_byte) / width));
+        }
+
+        if (++n_records == batch_size)
+            flush();
+    }
+
+    /* writes the last batch */
+    void finish()
+    {
+        flush();
+
+        for (column_t & col : columns)
+        {
+            col.values_stream.flush();
+            col.offsets_stream.flush();
+            if (!col.values_stream || !col.offsets_stream)
+                throw decovar_error{"Writing the columnar output failed."};
+        }
+    }
+};
@@ -0,0 +1,247 @@
+// MIT License
+//
+// Copyright (c) 2023 deCODE Genetics
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <optional>
+#include <ranges>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#    include <pthread.h>
+#    include <sched.h>
+#endif
+
+/* the size of the CPU masks */
+inline constexpr size_t max_cpus = 1024;
+
+namespace detail
+{
+
+/* "quota period" as in cgroup v2's cpu.max; quota may be "max" */
+inline std::optional<size_t> parse_cpu_quota(std::string const & quota, std::string const & period)
+{
+    size_t q = 0;
+    size_t p = 0;
+    if (std::from_chars(quota.data(), quota.data() + quota.size(), q).ec != std::errc{} ||
+        std::from_chars(period.data(), period.data() + period.size(), p).ec != std::errc{} || q == 0 || p == 0)
+    {
+        return std::nullopt; // "max", -1 or unreadable → no limit
+    }
+    return std::max<size_t>(1, (q + p - 1) / p);
+}
+
+/* Calls fn(dir) for the cgroup directory PATH below the mount point root and for all of its ancestors up to root. */
+template <typename fn_t>
+inline void for_each_cgroup_ancestor(std::filesystem::path const & root, std::string_view const path, fn_t && fn)
+{
+    for (std::filesystem::path dir = root / std::filesystem::path{path}.relative_path();; dir = dir.parent_path())
+    {
+        fn(dir);
+        if (dir == root || !dir.has_relative_path() || dir.string().size() <= root.string().size())
+            break;
+    }
+}
+
+/* The smallest CPU quota of the process' cgroup and its ancestors, for cgroup v2 and for the cgroup v1 CPU
+ * controller. Quotas are given in CPU time per period, so fractional CPUs are rounded up. */
+inline std::optional<size_t> cgroup_cpu_quota()
+{
+    std::optional<size_t> ret;
+    auto                  update = [&](std::optional<size_t> const q)
+    {
+        if (q)
+            ret = std::min(ret.value_or(std::numeric_limits<size_t>::max()), *q);
+    };
+
+    auto read_v2 = [&](std::filesystem::path const & dir)
+    {
+        std::ifstream cpu_max{dir / "cpu.max"};
+        std::string   quota;
+        std::string   period;
+        if (cpu_max >> quota >> period)
+            update(parse_cpu_quota(quota, period));
+    };
+
+    auto read_v1 = [&](std::filesystem::path const & dir)
+    {
+        std::ifstream quota_file{dir / "cpu.cfs_quota_us"};
+        std::ifstream period_file{dir / "cpu.cfs_period_us"};
+        std::string   quota;
+        std::string   period;
+        if (quota_file >> quota && period_file >> period)
+            update(parse_cpu_quota(quota, period));
+    };
+
+    /* lines are "ID:CONTROLLERS:PATH"; v2 has a single line "0::PATH", v1 one line per hierarchy */
+    std::ifstream proc{"/proc/self/cgroup"};
+    for (std::string line; std::getline(proc, line);)
+    {
+        size_t const first  = line.find(':');
+        size_t const second = first == std::string::npos ? first : line.find(':', first + 1);
+        if (second == std::string::npos)
+            continue;
+
+        std::string_view const controllers = std::string_view{line}.substr(first + 1, second - first - 1);
+        std::string_view const path        = std::string_view{line}.substr(second + 1);
+
+        if (controllers.empty())
+        {
+            for_each_cgroup_ancestor("/sys/fs/cgroup", path, read_v2);
+            continue;
+        }
+
+        for (auto && controller : controllers | std::views::split(','))
+        {
+            if (std::string_view{controller.begin(), controller.end()} != "cpu")
+                continue;
+
+            /* the hierarchy is mounted under the names of its controllers, e.g. "cpu,cpuacct", usually with a link
+             * named "cpu" */
+            for_each_cgroup_ancestor("/sys/fs/cgroup/" + std::string{controllers}, path, read_v1);
+            if (controllers != "cpu")
+                for_each_cgroup_ancestor("/sys/fs/cgroup/cpu", path, read_v1);
+        }
+    }
+
+    return ret;
+}
+
+} // namespace detail
+
+/* Number of CPUs that this process can actually use: hardware_concurrency() reports all CPUs of the host, even in
+ * containers and batch jobs that are limited by an affinity mask or a cgroup CPU quota. */
+inline size_t available_cpus()
+{
+    static size_t const n = []
+    {
+        size_t cpus = std::max(1u, std::thread::hardware_concurrency());
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0)
+            cpus = std::max(1, CPU_COUNT(&set));
+
+        if (std::optional<size_t> quota = detail::cgroup_cpu_quota(); quota)
+            cpus = std::min(cpus, *quota);
+#endif
+        return cpus;
+    }();
+
+    return n;
+}
+
+/* The CPUs in the affinity mask of the calling thread; empty if it cannot be determined. */
+inline std::vector<size_t> allowed_cpus()
+{
+    std::vector<size_t> ret;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        for (size_t cpu = 0; cpu < max_cpus; ++cpu)
+            if (CPU_ISSET(cpu, &set))
+                ret.push_back(cpu);
+#endif
+    return ret;
+}
+
+/* The CPUs in the affinity mask that the process started with; recorded on the first call, which must happen before
+ * any thread is pinned. */
+inline std::span<size_t const> process_cpus()
+{
+    static std::vector<size_t> const cpus = allowed_cpus();
+    return cpus;
+}
+
+/* A CPU list in the notation of taskset and cpusets, e.g. "0-3,8,10-11". */
+inline std::optional<std::vector<size_t>> parse_cpu_list(std::string_view const list)
+{
+    std::vector<size_t> ret;
+
+    auto parse_number = [](std::string_view const str, size_t & n)
+    {
+        auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), n);
+        return !str.empty() && ec == std::errc{} && ptr == str.data() + str.size() && n < max_cpus;
+    };
+
+    for (auto && subrange : list | std::views::split(','))
+    {
+        std::string_view const range{subrange.begin(), subrange.end()};
+        size_t const           dash  = std::min(range.find('-'), range.size());
+        size_t                 first = 0;
+        size_t                 last  = 0;
+
+        if (!parse_number(range.substr(0, dash), first) ||
+            !parse_number(dash < range.size() ? range.substr(dash + 1) : range, last) || last < first)
+        {
+            return std::nullopt;
+        }
+
+        for (size_t cpu = first; cpu <= last; ++cpu)
+            ret.push_back(cpu);
+    }
+
+    std::ranges::sort(ret);
+    ret.erase(std::ranges::unique(ret).begin(), ret.end());
+    return ret;
+}
+
+/* CPU sets of the thread groups of the pipeline; an empty set leaves the threads of a group on all CPUs of the
+ * process. */
+struct cpu_affinity
+{
+    std::vector<size_t> reader;    // (de)compression of the input and decoding
+    std::vector<size_t> transform; // main thread and thread pool
+    std::vector<size_t> writer;    // encoding and compression of the output
+};
+
+/* Pins the calling thread to the given CPUs; threads that it creates afterwards inherit the affinity. Memory that a
+ * thread touches first is placed on the NUMA node of its CPU, so buffers end up close to the threads filling them.
+ * An empty list restores the process' original mask, which a previously pinned group would otherwise pass on. */
+inline bool pin_current_thread(std::span<size_t const> cpus)
+{
+    if (cpus.empty())
+        cpus = process_cpus();
+    if (cpus.empty())
+        return true;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t const cpu : cpus)
+        CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,118 @@
+// MIT License
+//
+// Copyright (c) 2023 deCODE Genetics
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include <bio/io/var/header.hpp>
+#include <bio/io/var/record.hpp>
+
+#include "generator.hpp"
+#include "thread_pool.hpp"
+
+/* The in-process interface of libdecovar: the transforms of the subcommands on batches of records, without reading
+ * or writing files. A transform keeps its caches between calls and divides work between the threads of the given
+ * pool, which may be shared with other transforms, also ones that run on other threads. */
+namespace decovar
+{
+
+using record_t = bio::io::var::record_default;
+using header_t = bio::io::var::header;
+
+/* Options of allele_transform; see `decovar allele --help`. */
+struct allele_options
+{
+    float               rare_af_threshold  = 0ul;
+    size_t              local_alleles      = 0ul;
+    bool                auto_local_alleles = false;
+    bool                keep_global_fields = false;
+    bool                transform_all      = false;
+    size_t              pl_cap             = 0ul;
+    std::vector<size_t> split_by_length; // sorted thresholds; empty → no splitting
+    bool                split_by_class = false;
+};
+
+/* Options of binalleles_transform; see `decovar binalleles --help`. */
+struct binalleles_options
+{
+    bool   bin_by_length      = false;
+    bool   same_length_splits = false;
+    size_t pl_cap             = 0ul;
+    bool   plink_rows         = false; // compute the PLINK .bed row of every yielded record
+};
+
+/* Removes rare alleles, splits records by allele length/class and localises alleles (see `decovar allele`). */
+class allele_transform
+{
+private:
+    struct impl;
+    std::unique_ptr<impl> pimpl;
+
+public:
+    allele_transform(allele_options const & opts, header_t const & input_header, thread_pool & pool);
+    allele_transform(allele_transform &&) noexcept;
+    allele_transform & operator=(allele_transform &&) noexcept;
+    ~allele_transform();
+
+    /* the header of the transformed records */
+    header_t const & header() const noexcept;
+
+    /* Transforms the records; record_nos are their numbers in the input (for error messages). The results are
+     * valid until the next call; each record may be swapped with the result, the input records receive buffers of
+     * earlier results and the caller may swap results out, e.g. to write them on another thread. */
+    std::span<record_t> process(std::span<record_t> records, std::span<size_t const> record_nos);
+
+    /* number of the input record that every result of the last call was created from */
+    std::span<size_t const> record_nos() const noexcept;
+};
+
+/* Bins the alleles of multi-allelic records by length into biallelic records (see `decovar binalleles`). */
+class binalleles_transform
+{
+private:
+    struct impl;
+    std::unique_ptr<impl> pimpl;
+
+public:
+    binalleles_transform(binalleles_options const & opts, header_t const & input_header, thread_pool & pool);
+    binalleles_transform(binalleles_transform &&) noexcept;
+    binalleles_transform & operator=(binalleles_transform &&) noexcept;
+    ~binalleles_transform();
+
+    /* the header of the transformed records */
+    header_t const & header() const noexcept;
+
+    /* Yields the records created from the given ones; a yielded record is valid until the generator is resumed.
+     * Biallelic records and records that need no binning are yielded as-is. */
+    stage_generator<record_t &> process(std::span<record_t> records, std::span<size_t const> record_nos);
+
+    /* If opts.plink_rows is set, the PLINK .bed row of the record yielded last; empty if it has none. */
+    std::span<uint8_t const> plink_row() const noexcept;
+};
+
+} // namespace decovar
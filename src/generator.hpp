@@ -1,15 +1,105 @@
 #pragma once
 
+#include <cstddef>
+#include <new>
+#include <vector>
 #include <version>
 
 #if defined(__cpp_lib_generator) && __has_include(<generator>)
 #    include <generator>
 #else
-#    include "../submodules/generator/include/__generator.hpp"
+#    include <__generator.hpp> // from submodules/generator
 #endif
 
 #include <bio/ranges/views/detail.hpp>
 
+namespace decovar
+{
+
+namespace detail
+{
+
+/* Freed coroutine frames of the current thread, kept for reuse. */
+class frame_pool
+{
+private:
+    static constexpr size_t max_frames = 16;
+
+    std::vector<std::pair<size_t, void *>> frames; // size, memory
+
+public:
+    frame_pool() { frames.reserve(max_frames); }
+    frame_pool(frame_pool const &)             = delete;
+    frame_pool & operator=(frame_pool const &) = delete;
+
+    ~frame_pool()
+    {
+        for (auto [size, ptr] : frames)
+            ::operator delete(ptr);
+    }
+
+    void * allocate(size_t const size)
+    {
+        for (size_t i = frames.size(); i-- > 0;)
+        {
+            if (frames[i].first == size)
+            {
+                void * ptr = frames[i].second;
+                frames[i]  = frames.back();
+                frames.pop_back();
+                return ptr;
+            }
+        }
+        return ::operator new(size);
+    }
+
+    void deallocate(void * const ptr, size_t const size) noexcept
+    {
+        if (frames.size() < max_frames)
+            frames.emplace_back(size, ptr);
+        else
+            ::operator delete(ptr);
+    }
+
+    static frame_pool & get()
+    {
+        thread_local frame_pool pool;
+        return pool;
+    }
+};
+
+} // namespace detail
+
+/* Allocator for coroutine frames. The per-record stages create one frame per record and destroy it before the next
+ * one is created, so the frames are recycled instead of being returned to the heap every time. */
+template <typename value_t>
+struct recycling_allocator
+{
+    using value_type = value_t;
+
+    recycling_allocator() noexcept = default;
+
+    template <typename other_t>
+    recycling_allocator(recycling_allocator<other_t> const &) noexcept
+    {}
+
+    value_t * allocate(size_t const n)
+    {
+        return static_cast<value_t *>(detail::frame_pool::get().allocate(n * sizeof(value_t)));
+    }
+
+    void deallocate(value_t * const ptr, size_t const n) noexcept
+    {
+        detail::frame_pool::get().deallocate(ptr, n * sizeof(value_t));
+    }
+
+    friend bool operator==(recycling_allocator const &, recycling_allocator const &) noexcept { return true; }
+};
+
+/* The return type of per-record pipeline stages that may yield zero or more records. */
+template <typename ref_t>
+using stage_generator = std::generator<ref_t, void, recycling_allocator<std::byte>>;
+
 inline constexpr auto cojoin =
   []<std::ranges::input_range rng_t>(rng_t &&
                                      urange) requires(std::ranges::input_range<std::ranges::range_reference_t<rng_t>>)
@@ -22,3 +112,5 @@ inline constexpr auto cojoin =
 };
 
 inline constexpr auto views_cojoin = bio::ranges::detail::adaptor_from_functor{cojoin};
+
+} // namespace decovar
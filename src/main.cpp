@@ -6,6 +6,7 @@
 #include "allele/allele.hpp"
 #include "binalleles/binalleles.hpp"
 #include "misc.hpp"
+#include "plan/plan.hpp"
 
 int main(int argc, char ** argv)
 {
@@ -16,7 +17,7 @@ int main(int argc, char ** argv)
       argc,
       argv,
       sharg::update_notifications::off,
-      {"allele", "binalleles"}
+      {"allele", "binalleles", "plan"}
     };
     parser.info.author            = "Hannes Hauswedell";
     parser.info.short_description = "deCODE variant tools.";
@@ -34,6 +35,8 @@ int main(int argc, char ** argv)
             allele(sub_parser);
         else if (sub_parser.info.app_name == std::string_view{"decovar-binalleles"})
             _binalleles::main(sub_parser);
+        else if (sub_parser.info.app_name == std::string_view{"decovar-plan"})
+            _plan::main(sub_parser);
         else
             throw decovar_error{"Unhandled subcommand {} encountered. ", sub_parser.info.app_name};
 #ifdef NDEBUG
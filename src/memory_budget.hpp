@@ -0,0 +1,120 @@
+// MIT License
+//
+// Copyright (c) 2023 deCODE Genetics
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <variant>
+#include <vector>
+
+#include <bio/meta/overloaded.hpp>
+
+#include "misc.hpp"
+
+/* Approximate number of bytes held by the record's fields. */
+inline size_t record_bytes(record_t const & record)
+{
+    size_t bytes = sizeof(record_t) + record.chrom.size() + record.id.size() + record.ref.size();
+    for (auto const & alt : record.alt)
+        bytes += sizeof(alt) + alt.size();
+
+    auto visitor = bio::meta::overloaded{
+      []<typename T>(bio::ranges::concatenated_sequences<std::vector<T>> const & field)
+      { return field.raw_data().first.size() * sizeof(T) + field.raw_data().second.size() * sizeof(size_t); },
+      []<typename T>(std::vector<T> const & field) { return field.size() * sizeof(T); },
+      [](std::vector<std::string> const & field)
+      {
+          size_t n = 0;
+          for (std::string const & str : field)
+              n += sizeof(str) + str.size();
+          return n;
+      },
+      [](std::string const & field) { return field.size(); },
+      [](auto const &) { return size_t{0}; }};
+
+    for (auto const & [id, value] : record.info)
+        bytes += sizeof(id) + id.size() + std::visit(visitor, value);
+    for (auto const & [id, value] : record.genotypes)
+        bytes += sizeof(id) + id.size() + std::visit(visitor, value);
+
+    return bytes;
+}
+
+/* Bytes held by records that are in flight between the pipeline stages. Only the reading stage waits for room;
+ * all later stages account their records without waiting, so that they can always drain the pipeline. */
+class memory_budget
+{
+private:
+    size_t const            limit; // 0 → no limit
+    size_t                  in_use = 0;
+    mutable std::mutex      mtx;
+    std::condition_variable cv;
+
+public:
+    explicit memory_budget(size_t const limit) : limit{limit} {}
+
+    memory_budget(memory_budget const &)             = delete;
+    memory_budget & operator=(memory_budget const &) = delete;
+
+    void add(size_t const bytes)
+    {
+        std::lock_guard lock{mtx};
+        in_use += bytes;
+    }
+
+    void release(size_t const bytes)
+    {
+        {
+            std::lock_guard lock{mtx};
+            in_use -= std::min(bytes, in_use);
+        }
+        cv.notify_all();
+    }
+
+    bool exhausted() const
+    {
+        std::lock_guard lock{mtx};
+        return limit != 0 && in_use >= limit;
+    }
+
+    /* blocks while the budget is exhausted, unless abort() returns true */
+    template <typename abort_fn_t>
+    void wait_for_room(abort_fn_t && abort)
+    {
+        std::unique_lock lock{mtx};
+        cv.wait(lock, [&] { return limit == 0 || in_use < limit || abort(); });
+    }
+
+    /* wakes up waiting threads so that they can check their abort condition */
+    void interrupt()
+    {
+        {
+            std::lock_guard lock{mtx}; // the condition was changed before; waiters must not miss the notification
+        }
+        cv.notify_all();
+    }
+};
@@ -22,6 +22,24 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <concepts>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <initializer_list>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <ranges>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
 #include <bio/alphabet/fmt.hpp>
 #include <bio/io/format/vcf.hpp>
 #include <bio/io/stream/compression.hpp>
@@ -31,6 +49,8 @@
 
 #include <sharg/all.hpp>
 
+#include "cpus.hpp"
+
 using record_t = bio::io::var::record_default;
 using header_t = bio::io::var::header;
 
@@ -63,6 +83,7 @@ private:
 
 public:
     using base_t::base_t;
+    using base_t::operator(); // lists of files
 
     virtual void operator()(std::filesystem::path const & file) const override
     {
@@ -86,10 +107,243 @@ public:
     }
 };
 
+/* -@ 0 → all CPUs available to the process; the pipeline needs at least two threads */
+inline size_t resolve_thread_count(size_t const threads)
+{
+    if (threads == 0)
+        return std::max<size_t>(2, available_cpus());
+    if (threads == 1)
+        throw sharg::validation_error{"At least 2 threads are required (or 0 for all available CPUs)."};
+    return threads;
+}
+
+/* --cpu-affinity READER:TRANSFORM:WRITER, each a CPU list; empty lists leave a group on all CPUs of the process */
+inline cpu_affinity parse_cpu_affinity(std::string_view const arg)
+{
+    cpu_affinity ret;
+    if (arg.empty())
+        return ret;
+
+    std::span<size_t const> const allowed  = process_cpus(); // records the mask before any thread is pinned
+    std::vector<size_t> *         groups[] = {&ret.reader, &ret.transform, &ret.writer};
+    size_t                        g        = 0;
+
+    for (auto && subrange : arg | std::views::split(':'))
+    {
+        std::string_view const str{subrange.begin(), subrange.end()};
+        if (g == 3)
+            throw sharg::validation_error{"--cpu-affinity takes three CPU lists separated by ':'."};
+
+        if (!str.empty())
+        {
+            std::optional<std::vector<size_t>> cpus = parse_cpu_list(str);
+            if (!cpus)
+                throw sharg::validation_error{fmt::format("\"{}\" is not a valid CPU list, e.g. 0-3,8.", str)};
+
+            for (size_t const cpu : *cpus)
+                if (!allowed.empty() && !std::ranges::binary_search(allowed, cpu))
+                    throw sharg::validation_error{fmt::format("CPU {} is not available to this process.", cpu)};
+
+            *groups[g] = std::move(*cpus);
+        }
+        ++g;
+    }
+
+    if (g != 3)
+        throw sharg::validation_error{"--cpu-affinity takes three CPU lists separated by ':'."};
+
+    return ret;
+}
+
+// ============================================================================
+// Several input files
+// ============================================================================
+
+/* the input file's name without directory and .vcf/.vcf.gz/.bcf extension */
+inline std::string input_file_stem(std::filesystem::path const & input)
+{
+    std::string name = input.filename().string();
+    for (std::string_view const ext : {".vcf.gz", ".vcf", ".bcf"})
+    {
+        if (name.ends_with(ext))
+        {
+            name.resize(name.size() - ext.size());
+            break;
+        }
+    }
+    return name;
+}
+
+/* replaces every "{}" in an output path by the stem of the input file */
+inline std::filesystem::path expand_output_template(std::filesystem::path const & output,
+                                                    std::filesystem::path const & input)
+{
+    std::string       ret  = output.string();
+    std::string const stem = input_file_stem(input);
+    for (size_t pos = ret.find("{}"); pos != std::string::npos; pos = ret.find("{}", pos + stem.size()))
+        ret.replace(pos, 2, stem);
+    return ret;
+}
+
+/* An output path as given on the command line, which may contain "{}", and the suffixes of the files that are written
+ * for it, e.g. {".bed", ".bim", ".fam"} for a prefix. */
+struct output_template
+{
+    std::filesystem::path    path; // empty → not written
+    std::vector<std::string> suffixes{""};
+    std::vector<std::string> extensions{}; // valid extensions of the expanded path; empty → any
+};
+
+/* With several input files, every output path must contain "{}", so that the files write to different outputs. For
+ * every input file, the files that would be written must not exist yet and must all be different; so that no output
+ * is overwritten, also not by the output of another input file. */
+inline void validate_output_templates(std::span<std::filesystem::path const> const  inputs,
+                                      std::initializer_list<output_template> const outputs)
+{
+    if (inputs.size() > 1)
+    {
+        for (std::filesystem::path const & input : inputs)
+            if (input == "-" || input == "/dev/stdin")
+                throw sharg::validation_error{"Reading from stdin is only possible with a single input file."};
+
+        for (output_template const & output : outputs)
+        {
+            if (!output.path.empty() && output.path.string().find("{}") == std::string::npos)
+            {
+                throw sharg::validation_error{fmt::format("With several input files, output paths must contain {{}} "
+                                                          "for the input's name, but \"{}\" does not.",
+                                                          output.path.string())};
+            }
+        }
+
+        std::vector<std::string> stems;
+        for (std::filesystem::path const & input : inputs)
+            stems.push_back(input_file_stem(input));
+        std::ranges::sort(stems);
+        if (auto it = std::ranges::adjacent_find(stems); it != stems.end())
+            throw sharg::validation_error{fmt::format("Several input files are named \"{}\".", *it)};
+    }
+
+    std::vector<std::filesystem::path> files;
+    for (std::filesystem::path const & input : inputs)
+    {
+        for (output_template const & output : outputs)
+        {
+            if (output.path.empty() || output.path == "-" || output.path == "/dev/stdout")
+                continue;
+
+            std::filesystem::path const path = expand_output_template(output.path, input);
+            if (!output.extensions.empty() &&
+                std::ranges::none_of(output.extensions,
+                                     [&](std::string const & ext) { return path.string().ends_with("." + ext); }))
+            {
+                std::string extensions;
+                for (std::string const & ext : output.extensions)
+                    extensions += (extensions.empty() ? "." : ", .") + ext;
+                throw sharg::validation_error{
+                  fmt::format("The output file \"{}\" must end in one of {}.", path.string(), extensions)};
+            }
+
+            for (std::string const & suffix : output.suffixes)
+            {
+                std::filesystem::path file = path;
+                file += suffix;
+                if (std::filesystem::exists(file))
+                    throw sharg::validation_error{fmt::format("The output file \"{}\" already exists.", file.string())};
+                files.push_back(std::move(file));
+            }
+        }
+    }
+
+    std::ranges::sort(files);
+    if (auto it = std::ranges::adjacent_find(files); it != files.end())
+        throw sharg::validation_error{fmt::format("The output file \"{}\" would be written twice.", it->string())};
+}
+
+/* The threads of a file besides the ones it always has (main thread, decoding, …): decompression, compression and
+ * the file's share of the transform pool. They run at the same time, so together they stay within the file's share
+ * of -@. */
+struct file_threads_t
+{
+    size_t reader = 0; // decompression, besides decoding
+    size_t writer = 0; // compression
+    size_t pool   = 0; // workers of the transform pool
+};
+
+inline file_threads_t divide_file_threads(size_t const threads, size_t const fixed)
+{
+    size_t const   rest = threads - std::min(threads, fixed);
+    file_threads_t ret{.reader = rest / 4};
+    ret.pool   = (rest - ret.reader) / 2;
+    ret.writer = rest - ret.reader - ret.pool;
+    return ret;
+}
+
+/* Several files are processed at the same time, so that every file gets at least four of the threads. */
+inline size_t concurrent_files(size_t const n_files, size_t const threads)
+{
+    return std::clamp<size_t>(threads / 4, 1, std::max<size_t>(n_files, 1));
+}
+
+/* Calls fn(i) for every file i; up to n_concurrent files at the same time. No further files are started after an
+ * exception; the first one is rethrown. */
+template <typename fn_t>
+inline void for_each_file(size_t const n_files, size_t const n_concurrent, fn_t && fn)
+{
+    if (n_concurrent <= 1)
+    {
+        for (size_t i = 0; i < n_files; ++i)
+            fn(i);
+        return;
+    }
+
+    std::atomic<size_t> next_file = 0;
+    std::atomic<bool>   failed    = false;
+    std::mutex          mtx;
+    std::exception_ptr  first_exception;
+
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < n_concurrent; ++t)
+    {
+        threads.emplace_back(
+          [&]
+          {
+              for (size_t i = next_file++; i < n_files && !failed; i = next_file++)
+              {
+                  try
+                  {
+                      fn(i);
+                  }
+                  catch (...)
+                  {
+                      std::lock_guard lock{mtx};
+                      if (!first_exception)
+                          first_exception = std::current_exception();
+                      failed = true;
+                  }
+              }
+          });
+    }
+
+    for (std::thread & t : threads)
+        t.join();
+
+    if (first_exception)
+        std::rethrow_exception(first_exception);
+}
+
 // ============================================================================
 // Initialisation and program setup
 // ============================================================================
 
+/* Threads inherit the CPU affinity of the thread that creates them; so the calling thread is pinned to a group's CPUs
+ * before that group's threads are started. */
+inline void pin_thread_group(std::vector<size_t> const & cpus)
+{
+    if (!pin_current_thread(cpus))
+        throw decovar_error{"Could not pin threads to the CPUs given by --cpu-affinity."};
+}
+
 // TODO we need to move more of this into bioc++
 inline auto create_writer(std::filesystem::path const & filename, char format, size_t const threads)
 {
@@ -149,3 +403,116 @@ inline void concatenated_sequences_create_scaffold(bio::ranges::concatenated_seq
 
     assert(data_delim.back() == data_vec.size());
 }
+
+// ============================================================================
+// Integer width selection
+// ============================================================================
+
+/* BCF reserves the eight smallest values of every integer width for "missing", "end-of-vector" and future use;
+ * regular values need to be larger than this */
+template <std::signed_integral int_t>
+inline constexpr int64_t bcf_int_lowest = int64_t{std::numeric_limits<int_t>::min()} + 8;
+
+/* minimum and maximum of all regular (non-reserved) values; {0, 0} if there are none */
+template <std::signed_integral int_t>
+inline std::pair<int64_t, int64_t> regular_value_range(std::span<int_t const> const values)
+{
+    int64_t min = std::numeric_limits<int64_t>::max();
+    int64_t max = std::numeric_limits<int64_t>::min();
+
+    for (int_t const v : values)
+    {
+        if (v >= bcf_int_lowest<int_t>)
+        {
+            min = std::min<int64_t>(min, v);
+            max = std::max<int64_t>(max, v);
+        }
+    }
+
+    if (min > max)
+        return {0, 0};
+    return {min, max};
+}
+
+/* invokes fn with std::type_identity<int_t> for the narrowest signed type that can represent [min, max] in BCF */
+template <typename fn_t>
+inline decltype(auto) visit_narrowest_int(int64_t const min, int64_t const max, fn_t && fn)
+{
+    if (min >= bcf_int_lowest<int8_t> && max <= std::numeric_limits<int8_t>::max())
+        return fn(std::type_identity<int8_t>{});
+    else if (min >= bcf_int_lowest<int16_t> && max <= std::numeric_limits<int16_t>::max())
+        return fn(std::type_identity<int16_t>{});
+    else
+        return fn(std::type_identity<int32_t>{});
+}
+
+/* converts a single value, mapping the reserved values (missing, end-of-vector, ...) onto their counterparts */
+template <std::signed_integral out_t, std::signed_integral in_t>
+inline out_t convert_int_value(in_t const v)
+{
+    if constexpr (sizeof(out_t) != sizeof(in_t))
+    {
+        if (v < bcf_int_lowest<in_t>)
+            return static_cast<out_t>(std::numeric_limits<out_t>::min() + (v - std::numeric_limits<in_t>::min()));
+    }
+    return static_cast<out_t>(v);
+}
+
+/* copy all values of in to out; the caller needs to make sure that the values fit */
+template <std::signed_integral in_t, std::signed_integral out_t>
+inline void concatenated_sequences_convert(bio::ranges::concatenated_sequences<std::vector<in_t>> const & in,
+                                           bio::ranges::concatenated_sequences<std::vector<out_t>> &      out)
+{
+    out.clear();
+    auto && [in_data, in_delim]   = in.raw_data();
+    auto && [out_data, out_delim] = out.raw_data();
+
+    out_delim.assign(in_delim.begin(), in_delim.end());
+    out_data.resize(in_data.size());
+    for (size_t i = 0; i < in_data.size(); ++i)
+        out_data[i] = convert_int_value<out_t>(in_data[i]);
+
+    assert(out_delim.back() == out_data.size());
+}
+
+/* converts an integer FORMAT field to the narrowest width that holds all of its values */
+template <typename variant_t>
+inline void narrow_genotype_field(variant_t & value)
+{
+    std::optional<variant_t> narrowed;
+
+    auto visitor = bio::meta::overloaded{
+      [&]<std::signed_integral int_t>(bio::ranges::concatenated_sequences<std::vector<int_t>> const & field)
+      {
+          auto [min, max] = regular_value_range<int_t>(field.raw_data().first);
+
+          auto fn = [&]<std::signed_integral out_t>(std::type_identity<out_t>)
+          {
+              if constexpr (sizeof(out_t) < sizeof(int_t))
+              {
+                  bio::ranges::concatenated_sequences<std::vector<out_t>> out;
+                  concatenated_sequences_convert(field, out);
+                  narrowed = std::move(out);
+              }
+          };
+
+          visit_narrowest_int(min, max, fn);
+      },
+      [](auto const &) {}};
+
+    std::visit(visitor, value);
+
+    if (narrowed)
+        value = std::move(*narrowed);
+}
+
+/* the largest PL value that is emitted; larger values carry no practical information (pl_cap == 0 → no capping) */
+template <typename pl_t>
+inline pl_t effective_pl_cap(size_t const pl_cap)
+{
+    if constexpr (!std::integral<pl_t>)
+        return std::numeric_limits<pl_t>::max();
+    else if (pl_cap == 0 || pl_cap > static_cast<size_t>(std::numeric_limits<pl_t>::max()))
+        return std::numeric_limits<pl_t>::max();
+    return static_cast<pl_t>(pl_cap);
+}
@@ -0,0 +1,218 @@
+// MIT License
+//
+// Copyright (c) 2023 deCODE Genetics
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <istream>
+#include <map>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <bio/io/stream/transparent_istream.hpp>
+
+#include "../misc.hpp"
+#include "sample.hpp"
+
+namespace _plan
+{
+
+/* Estimated cost of the records that start in a window of the index (see record_sampler). */
+struct window_t
+{
+    uint64_t begin = 0; // 0-based
+    uint64_t end   = 0; // exclusive
+    uint64_t cost  = 0;
+};
+
+struct index_costs
+{
+    std::vector<std::string>           names;   // per reference; empty if the index does not contain them
+    std::vector<std::vector<window_t>> windows; // per reference; sorted and non-overlapping
+};
+
+using chunks_t = std::vector<std::pair<uint64_t, uint64_t>>; // virtual file offsets: begin, end
+
+namespace detail
+{
+
+template <typename int_t>
+inline int_t read_value(std::istream & in)
+{
+    int_t value{};
+    if (!in.read(reinterpret_cast<char *>(&value), sizeof(value)))
+        throw decovar_error{"Index file is truncated."};
+    return value;
+}
+
+/* the names block of TBI files and the auxiliary data of CSI files for VCF */
+inline std::vector<std::string> read_names(std::istream & in, int32_t const l_nm)
+{
+    if (l_nm < 0)
+        throw decovar_error{"Index file is corrupt."};
+
+    std::string block(l_nm, '\0');
+    if (!in.read(block.data(), l_nm))
+        throw decovar_error{"Index file is truncated."};
+
+    std::vector<std::string> names;
+    for (size_t begin = 0; begin < block.size();)
+    {
+        size_t const end = std::min(block.find('\0', begin), block.size());
+        names.emplace_back(block, begin, end - begin);
+        begin = end + 1;
+    }
+    return names;
+}
+
+/* the binning scheme of SAM/BAM/VCF indexes: level l has 8^l bins that start at ((8^l) - 1) / 7 */
+inline window_t bin_window(uint32_t const bin, int32_t const min_shift, int32_t const depth)
+{
+    for (int32_t level = depth; level >= 0; --level)
+    {
+        uint32_t const first = ((1u << (3 * level)) - 1) / 7;
+        if (bin >= first)
+        {
+            int32_t const  shift = min_shift + 3 * (depth - level);
+            uint64_t const beg   = uint64_t{bin - first} << shift;
+            return {beg, beg + (uint64_t{1} << shift), 0};
+        }
+    }
+    return {};
+}
+
+} // namespace detail
+
+/* Reads a TBI or CSI index (BGZF-compressed) and estimates the cost of the chunks of every window with the sampler.
+ * The records in bins above the lowest level (i.e. records that span several windows) are attributed to the first
+ * window they overlap. */
+inline index_costs read_index_costs(std::filesystem::path const & path, record_sampler & sampler)
+{
+    bio::io::transparent_istream in{path};
+
+    char magic[4]{};
+    in.read(magic, 4);
+    std::string_view const magic_v{magic, 4};
+
+    bool const  csi       = magic_v == std::string_view{"CSI\1", 4};
+    int32_t     min_shift = 14; // TBI
+    int32_t     depth     = 5;  // TBI
+    int32_t     n_ref     = 0;
+    index_costs ret;
+
+    if (csi)
+    {
+        min_shift           = detail::read_value<int32_t>(in);
+        depth               = detail::read_value<int32_t>(in);
+        int32_t const l_aux = detail::read_value<int32_t>(in);
+
+        if (l_aux >= 28) // tabix meta data followed by the names (VCF)
+        {
+            for (size_t i = 0; i < 6; ++i)
+                detail::read_value<int32_t>(in);
+            int32_t const l_nm = detail::read_value<int32_t>(in);
+            ret.names          = detail::read_names(in, l_nm);
+            detail::read_names(in, l_aux - 28 - l_nm); // skip the rest
+        }
+        else
+        {
+            detail::read_names(in, l_aux); // skip; BCF has no names in the index
+        }
+
+        n_ref = detail::read_value<int32_t>(in);
+    }
+    else if (magic_v == std::string_view{"TBI\1", 4})
+    {
+        n_ref = detail::read_value<int32_t>(in);
+        for (size_t i = 0; i < 6; ++i)
+            detail::read_value<int32_t>(in);
+        ret.names = detail::read_names(in, detail::read_value<int32_t>(in));
+    }
+    else
+    {
+        throw decovar_error{"{} is neither a CSI nor a TBI index.", path.string()};
+    }
+
+    if (min_shift < 0 || depth < 0 || min_shift + 3 * depth > 62 || n_ref < 0)
+        throw decovar_error{"Index file {} has an invalid binning scheme.", path.string()};
+
+    uint32_t const pseudo_bin = ((1u << (3 * (depth + 1))) - 1) / 7 + 1; // holds meta data, not records
+
+    ret.windows.resize(n_ref);
+    chunks_t bin_chunks;
+    for (int32_t r = 0; r < n_ref; ++r)
+    {
+        std::map<uint64_t, std::pair<window_t, chunks_t>> windows; // by begin
+        int32_t const                                     n_bin = detail::read_value<int32_t>(in);
+
+        for (int32_t b = 0; b < n_bin; ++b)
+        {
+            uint32_t const bin = detail::read_value<uint32_t>(in);
+            if (csi)
+                detail::read_value<uint64_t>(in); // loffset
+            int32_t const n_chunk = detail::read_value<int32_t>(in);
+
+            bin_chunks.clear();
+            for (int32_t c = 0; c < n_chunk; ++c)
+            {
+                uint64_t const beg = detail::read_value<uint64_t>(in);
+                uint64_t const end = detail::read_value<uint64_t>(in);
+                bin_chunks.emplace_back(beg, end);
+            }
+
+            if (bin == pseudo_bin)
+                continue;
+
+            window_t       bin_w       = detail::bin_window(bin, min_shift, depth);
+            uint64_t const width       = uint64_t{1} << min_shift;
+            auto &         [w, chunks] = windows[bin_w.begin];
+            w.begin                    = bin_w.begin;
+            w.end                      = bin_w.begin + width;
+            chunks.insert(chunks.end(), bin_chunks.begin(), bin_chunks.end());
+        }
+
+        if (!csi) // linear index
+        {
+            int32_t const n_intv = detail::read_value<int32_t>(in);
+            for (int32_t i = 0; i < n_intv; ++i)
+                detail::read_value<uint64_t>(in);
+        }
+
+        ret.windows[r].reserve(windows.size());
+        for (auto & [begin, window] : windows)
+        {
+            auto & [w, chunks] = window;
+            w.cost             = sampler.window_cost(chunks);
+            ret.windows[r].push_back(w);
+        }
+    }
+
+    return ret;
+}
+
+} // namespace _plan
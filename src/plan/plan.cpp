@@ -0,0 +1,156 @@
+// MIT License
+//
+// Copyright (c) 2023 deCODE Genetics
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "plan.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <bio/io/var/header.hpp>
+#include <bio/io/var/reader.hpp>
+
+#include <sharg/all.hpp>
+
+#include "../misc.hpp"
+#include "index.hpp"
+#include "sample.hpp"
+#include "shards.hpp"
+
+namespace _plan
+{
+
+program_options parse_options(sharg::parser & parser)
+{
+    program_options opts;
+
+    parser.add_flag(
+      opts.verbose,
+      sharg::config{.short_id = 'v', .long_id = "verbose", .description = "Print diagnostics to stderr."});
+
+    parser.add_subsection("Input / Output:");
+    parser.add_positional_option(opts.input_file,
+                                 sharg::config{.description = "Path to the indexed input file.",
+                                               .required    = true,
+                                               .validator   = sharg::input_file_validator{{"vcf.gz", "bcf"}}});
+    parser.add_option(opts.index_file,
+                      sharg::config{.short_id    = 'i',
+                                    .long_id     = "index",
+                                    .description = "Path to the CSI or TBI index. Default: INPUT.csi or INPUT.tbi.",
+                                    .validator   = sharg::input_file_validator{{"csi", "tbi"}}});
+    parser.add_option(opts.output_file,
+                      sharg::config{
+                        .short_id    = 'o',
+                        .long_id     = "output",
+                        .description = "Path to output file or '-' for stdout.",
+                        .validator   = output_file_or_stdout_validator{sharg::output_file_open_options::create_new,
+                                                                       {"bed", "json"}}
+    });
+    parser.add_option(opts.format,
+                      sharg::config{.short_id    = 'O',
+                                    .long_id     = "output-type",
+                                    .description = "BED (chrom, begin, end, shard, cost of the shard; a shard may "
+                                                   "have several lines) or JSON (an array of shards with their "
+                                                   "regions). Coordinates are 0-based and the ends exclusive. "
+                                                   "Default: json if the output file ends in .json, else bed.",
+                                    .validator   = sharg::value_list_validator{"bed", "json"}});
+
+    parser.add_subsection("Sharding:");
+    parser.add_line("Divides the genome into shards of similar estimated processing cost. For every window of the "
+                    "index, the headers of a few records are read; the cost of the window is its estimated number of "
+                    "records (from its uncompressed size) times their mean number of genotype values (samples × "
+                    "genotypes).",
+                    true);
+    parser.add_option(opts.shards,
+                      sharg::config{.short_id    = 'n',
+                                    .long_id     = "shards",
+                                    .description = "Number of shards; fewer are created if the index has fewer "
+                                                   "windows with records.",
+                                    .validator   = sharg::arithmetic_range_validator{1, 1'000'000}});
+
+    parser.parse();
+
+    if (!parser.is_option_set('O') && opts.output_file.extension() == ".json")
+        opts.format = "json";
+
+    if (opts.index_file.empty())
+    {
+        for (char const * const ext : {".csi", ".tbi"})
+        {
+            std::filesystem::path index_file = opts.input_file;
+            index_file += ext;
+            if (std::filesystem::exists(index_file))
+            {
+                opts.index_file = std::move(index_file);
+                break;
+            }
+        }
+
+        if (opts.index_file.empty())
+            throw sharg::validation_error{"No index found for the input file; create one or pass --index."};
+    }
+
+    return opts;
+}
+
+void main(sharg::parser & parser)
+{
+    program_options opts = parse_options(parser);
+
+    bio::io::var::reader reader{opts.input_file};
+    header_t const &     hdr       = reader.header();
+    bool const           bcf       = opts.input_file.extension() == ".bcf";
+    size_t const         n_samples = hdr.column_labels.size() - std::min<size_t>(9, hdr.column_labels.size());
+
+    record_sampler    sampler{opts.input_file, bcf, n_samples};
+    index_costs const costs = read_index_costs(opts.index_file, sampler);
+
+    /* BCF indexes do not contain the names of the references; they are numbered like the contigs in the header */
+    std::vector<std::string> header_names;
+    if (costs.names.size() < costs.windows.size())
+        for (auto const & contig : hdr.contigs)
+            header_names.push_back(contig.id);
+
+    std::vector<shard_t> const shards = plan_shards(costs, opts.shards);
+    log(opts, "Planned {} shards from {}.\n", shards.size(), opts.index_file.string());
+
+    std::ofstream file;
+    if (opts.output_file != "-")
+    {
+        file.open(opts.output_file);
+        if (!file)
+            throw decovar_error{"Could not open {} for writing.", opts.output_file.string()};
+    }
+    std::ostream & out = opts.output_file == "-" ? std::cout : file;
+
+    if (opts.format == "json")
+        write_json(out, shards, costs, header_names);
+    else
+        write_bed(out, shards, costs, header_names);
+}
+
+} // namespace _plan
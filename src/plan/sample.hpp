@@ -0,0 +1,288 @@
+// MIT License
+//
+// Copyright (c) 2023 deCODE Genetics
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <span>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <zlib.h>
+
+#include "../misc.hpp"
+
+namespace _plan
+{
+
+/* Reads the headers of a few records at a virtual offset of the (BGZF-compressed) input to estimate what the records
+ * of a window cost: the number of records is estimated from the uncompressed size of the window and the cost of a
+ * record is samples × genotypes, i.e. the number of PL values that localising and binning process. */
+class record_sampler
+{
+private:
+    static constexpr size_t max_records = 16;      // sampled per window
+    static constexpr size_t max_bytes   = 1 << 20; // blocks are not inflated beyond this (uncompressed)
+
+    struct block_t
+    {
+        uint64_t          coffset = 0;
+        uint64_t          csize   = 0; // compressed size, including the BGZF header and footer
+        std::vector<char> data;        // uncompressed
+    };
+
+    struct sample_t
+    {
+        size_t   n_records = 0;
+        uint64_t bytes     = 0; // uncompressed size of the sampled records
+        uint64_t cost      = 0; // of the sampled records
+        double   ratio     = 1; // uncompressed / compressed size of the inflated blocks
+    };
+
+    std::filesystem::path path;
+    std::ifstream         file;
+    uint64_t              file_size = 0;
+    bool                  bcf       = false;
+    uint64_t              n_samples = 1;
+
+    std::vector<block_t> blocks; // inflated for the last sample; consecutive windows often start in the same block
+    std::vector<block_t> prev_blocks;
+    std::vector<char>    compressed;
+    std::vector<char>    buf; // the inflated bytes from the sampled virtual offset
+
+    block_t inflate_block(uint64_t const coffset)
+    {
+        for (block_t & b : prev_blocks)
+        {
+            if (b.coffset == coffset && b.csize > 0)
+            {
+                block_t ret = std::move(b);
+                b.csize     = 0;
+                return ret;
+            }
+        }
+
+        block_t    b;
+        char       header[18];
+        auto const corrupt = [&] { return decovar_error{"{} is not BGZF-compressed or is corrupt.", path.string()}; };
+
+        b.coffset = coffset;
+        file.clear();
+        file.seekg(coffset);
+        if (!file.read(header, 18) || header[0] != '\37' || header[1] != '\213' || header[2] != '\10' ||
+            header[3] != '\4')
+            throw corrupt();
+
+        /* the standard BGZF header has the "BC" subfield with the block size first */
+        uint16_t xlen  = 0;
+        uint16_t bsize = 0;
+        std::memcpy(&xlen, header + 10, 2);
+        std::memcpy(&bsize, header + 16, 2);
+        if (xlen != 6 || header[12] != 'B' || header[13] != 'C' || bsize < 25)
+            throw corrupt();
+
+        b.csize = uint64_t{bsize} + 1;
+        compressed.resize(b.csize - 18);
+        if (!file.read(compressed.data(), compressed.size()))
+            throw corrupt();
+
+        uint32_t isize = 0;
+        std::memcpy(&isize, compressed.data() + compressed.size() - 4, 4);
+        b.data.resize(isize);
+
+        z_stream zs{};
+        zs.next_in   = reinterpret_cast<Bytef *>(compressed.data());
+        zs.avail_in  = compressed.size() - 8;
+        zs.next_out  = reinterpret_cast<Bytef *>(b.data.data());
+        zs.avail_out = isize;
+        if (inflateInit2(&zs, -15) != Z_OK)
+            throw corrupt();
+        int const status = inflate(&zs, Z_FINISH);
+        inflateEnd(&zs);
+        if (status != Z_STREAM_END || zs.total_out != isize)
+            throw corrupt();
+
+        return b;
+    }
+
+    /* appends the next block to buf; false at the end of the file or of the sampling budget */
+    bool inflate_next(uint64_t & next_coffset)
+    {
+        if (buf.size() >= max_bytes || next_coffset >= file_size)
+            return false;
+
+        blocks.push_back(inflate_block(next_coffset));
+        next_coffset += blocks.back().csize;
+        buf.insert(buf.end(), blocks.back().data.begin(), blocks.back().data.end());
+        return true;
+    }
+
+    /* samples × diploid genotypes (n_alleles + 1 choose 2) */
+    uint64_t record_cost(uint64_t const n_alleles) const
+    {
+        return n_samples * std::max<uint64_t>(1, n_alleles * (n_alleles + 1) / 2);
+    }
+
+    sample_t sample(uint64_t const voffset, uint64_t const end_voffset)
+    {
+        std::swap(blocks, prev_blocks);
+        blocks.clear();
+        buf.clear();
+
+        uint64_t next_coffset = voffset >> 16;
+        size_t   pos          = voffset & 0xFFFF;
+        sample_t ret;
+
+        /* the sample ends at the end of the chunk */
+        auto const at_end = [&]
+        {
+            uint64_t coffset = voffset >> 16;
+            size_t   offset  = pos;
+            for (block_t const & b : blocks)
+            {
+                if (offset < b.data.size())
+                    break;
+                offset -= b.data.size();
+                coffset += b.csize;
+            }
+            return ((coffset << 16) | offset) >= end_voffset;
+        };
+
+        while (ret.n_records < max_records && !at_end())
+        {
+            if (bcf)
+            {
+                while (buf.size() < pos + 32 && inflate_next(next_coffset))
+                    ;
+                if (buf.size() < pos + 32)
+                    break;
+
+                uint32_t l_shared      = 0;
+                uint32_t l_indiv       = 0;
+                uint32_t n_allele_info = 0; // n_allele << 16 | n_info
+                std::memcpy(&l_shared, buf.data() + pos, 4);
+                std::memcpy(&l_indiv, buf.data() + pos + 4, 4);
+                std::memcpy(&n_allele_info, buf.data() + pos + 24, 4);
+
+                uint64_t const size = uint64_t{8} + l_shared + l_indiv;
+                ret.bytes += size;
+                ret.cost += record_cost(n_allele_info >> 16);
+                ++ret.n_records;
+
+                while (buf.size() < pos + size && inflate_next(next_coffset))
+                    ;
+                if (buf.size() < pos + size) // the size of the record is known, but not where the next one is
+                    break;
+                pos += size;
+            }
+            else
+            {
+                size_t line_end = std::string_view::npos;
+                while ((line_end = std::string_view{buf.data(), buf.size()}.find('\n', pos)) ==
+                         std::string_view::npos &&
+                       inflate_next(next_coffset))
+                    ;
+
+                if (buf.size() <= pos)
+                    break;
+
+                /* without a line end, the line is longer than the budget; its sampled part is a lower bound */
+                std::string_view const line{buf.data() + pos, std::min(line_end, buf.size()) - pos};
+                if (line.empty())
+                    break;
+
+                size_t field_begin = 0;
+                for (size_t i = 0; i < 4 && field_begin != std::string_view::npos; ++i)
+                    field_begin = line.find('\t', field_begin + (i > 0));
+                if (field_begin == std::string_view::npos)
+                    break;
+                std::string_view alt = line.substr(field_begin + 1);
+                alt                  = alt.substr(0, alt.find('\t'));
+
+                ret.bytes += line.size() + 1;
+                ret.cost += record_cost(alt == "." ? 1 : 2 + std::ranges::count(alt, ','));
+                ++ret.n_records;
+
+                if (line_end == std::string_view::npos)
+                    break;
+                pos = line_end + 1;
+            }
+        }
+
+        uint64_t inflated = 0;
+        uint64_t csize    = 0;
+        for (block_t const & b : blocks)
+        {
+            inflated += b.data.size();
+            csize += b.csize;
+        }
+        if (csize > 0)
+            ret.ratio = static_cast<double>(inflated) / csize;
+
+        return ret;
+    }
+
+public:
+    record_sampler(std::filesystem::path const & path, bool const bcf, size_t const n_samples) :
+      path{path},
+      file{path, std::ios::binary},
+      bcf{bcf},
+      n_samples{std::max<uint64_t>(1, n_samples)}
+    {
+        if (!file)
+            throw decovar_error{"Could not open {} for reading.", path.string()};
+        file_size = std::filesystem::file_size(path);
+    }
+
+    /* Estimated cost of the records in the chunks (pairs of virtual file offsets) of a window; the records at the
+     * first chunk are sampled. */
+    uint64_t window_cost(std::span<std::pair<uint64_t, uint64_t> const> const chunks)
+    {
+        if (chunks.empty())
+            return 0;
+
+        auto const first = std::ranges::min_element(chunks);
+        sample_t   s     = sample(first->first, first->second);
+
+        double bytes = 0; // uncompressed size of the window
+        for (auto const & [beg, end] : chunks)
+        {
+            double const within = static_cast<double>(end & 0xFFFF) - static_cast<double>(beg & 0xFFFF);
+            double const n_blocks = static_cast<double>((end >> 16) - std::min(end >> 16, beg >> 16));
+            bytes += std::max(0.0, n_blocks * s.ratio + within);
+        }
+
+        if (s.n_records == 0 || s.bytes == 0) // e.g. a chunk at the end of the file
+            return std::max<uint64_t>(1, static_cast<uint64_t>(bytes));
+
+        return std::max<uint64_t>(1, static_cast<uint64_t>(bytes / s.bytes * s.cost));
+    }
+};
+
+} // namespace _plan
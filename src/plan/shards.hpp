@@ -0,0 +1,162 @@
+// MIT License
+//
+// Copyright (c) 2023 deCODE Genetics
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "../misc.hpp"
+#include "index.hpp"
+
+namespace _plan
+{
+
+struct region_t
+{
+    size_t   ref   = 0;
+    uint64_t begin = 0; // 0-based
+    uint64_t end   = 0; // exclusive
+};
+
+/* a shard is a contiguous part of the genome; it has several regions if it spans references */
+struct shard_t
+{
+    std::vector<region_t> regions;
+    uint64_t              cost = 0;
+};
+
+/* Divides the windows (in the order of the index) into at most n_shards shards of similar cost. Shards end at window
+ * boundaries, so a single expensive window can make its shard more expensive than the others. */
+inline std::vector<shard_t> plan_shards(index_costs const & costs, size_t const n_shards)
+{
+    uint64_t total = 0;
+    for (std::vector<window_t> const & windows : costs.windows)
+        for (window_t const & w : windows)
+            total += w.cost;
+
+    std::vector<shard_t> shards;
+    if (total == 0 || n_shards == 0)
+        return shards;
+
+    shards.emplace_back();
+    uint64_t cum_cost = 0;
+
+    for (size_t r = 0; r < costs.windows.size(); ++r)
+    {
+        uint64_t prev_end = 0; // regions are extended over the gaps between windows, so that shards cover everything
+
+        for (window_t const & w : costs.windows[r])
+        {
+            /* start a new shard if the middle of the window is past the current shard's share of the total */
+            if (shards.back().cost > 0 && (2 * cum_cost + w.cost) * n_shards >= 2 * shards.size() * total)
+                shards.emplace_back();
+
+            shard_t & shard = shards.back();
+            if (shard.regions.empty() || shard.regions.back().ref != r)
+                shard.regions.push_back({r, prev_end, w.end});
+
+            shard.regions.back().end = w.end;
+            shard.cost += w.cost;
+            cum_cost += w.cost;
+            prev_end = w.end;
+        }
+    }
+
+    return shards;
+}
+
+/* name of a reference; the index' names take precedence over the header's */
+inline std::string_view ref_name(index_costs const &                 costs,
+                                 std::span<std::string const> const header_names,
+                                 size_t const                       ref)
+{
+    if (ref < costs.names.size())
+        return costs.names[ref];
+    if (ref < header_names.size())
+        return header_names[ref];
+    throw decovar_error{"No name for reference no {} in the index or in the header.", ref};
+}
+
+/* BED: chrom, begin, end, shard no, cost of the shard */
+inline void write_bed(std::ostream &                      out,
+                      std::span<shard_t const> const      shards,
+                      index_costs const &                 costs,
+                      std::span<std::string const> const header_names)
+{
+    for (size_t s = 0; s < shards.size(); ++s)
+    {
+        for (region_t const & region : shards[s].regions)
+        {
+            out << fmt::format("{}\t{}\t{}\tshard{}\t{}\n",
+                               ref_name(costs, header_names, region.ref),
+                               region.begin,
+                               region.end,
+                               s,
+                               shards[s].cost);
+        }
+    }
+}
+
+inline std::string json_escape(std::string_view const str)
+{
+    std::string ret;
+    for (char const c : str)
+    {
+        if (c == '"' || c == '\\')
+            ret.push_back('\\');
+        ret.push_back(c);
+    }
+    return ret;
+}
+
+/* JSON: an array of shards, each with its cost and its regions (0-based, end exclusive) */
+inline void write_json(std::ostream &                      out,
+                       std::span<shard_t const> const      shards,
+                       index_costs const &                 costs,
+                       std::span<std::string const> const header_names)
+{
+    out << "[\n";
+    for (size_t s = 0; s < shards.size(); ++s)
+    {
+        out << fmt::format("  {{\"shard\": {}, \"cost\": {}, \"regions\": [", s, shards[s].cost);
+        for (size_t i = 0; i < shards[s].regions.size(); ++i)
+        {
+            region_t const & region = shards[s].regions[i];
+            out << fmt::format("{}{{\"chrom\": \"{}\", \"begin\": {}, \"end\": {}}}",
+                               i > 0 ? ", " : "",
+                               json_escape(ref_name(costs, header_names, region.ref)),
+                               region.begin,
+                               region.end);
+        }
+        out << (s + 1 < shards.size() ? "]},\n" : "]}\n");
+    }
+    out << "]\n";
+}
+
+} // namespace _plan
@@ -0,0 +1,196 @@
+// MIT License
+//
+// Copyright (c) 2023 deCODE Genetics
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <ranges>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "generator.hpp"
+#include "memory_budget.hpp"
+#include "misc.hpp"
+
+/* Decodes records on a separate thread, so that decoding overlaps with the processing of earlier records.
+ * Records are swapped out of the source into a few batches that are handed over in order; the source gets the
+ * buffers of earlier records back and refills them. Reading pauses while the memory budget is exhausted, unless the
+ * consumer has run out of records: then the records it holds are all that is left to release. */
+template <std::ranges::input_range source_t>
+class read_ahead
+{
+public:
+    static constexpr size_t batch_size = 64;
+    static constexpr size_t n_slots    = 3;
+
+private:
+    struct slot_t
+    {
+        std::vector<record_t> records      = std::vector<record_t>(batch_size);
+        std::vector<size_t>   record_bytes = std::vector<size_t>(batch_size); // accounted in the memory budget
+        size_t                size         = 0;
+        size_t                bytes        = 0;
+        bool                  full         = false;
+    };
+
+    source_t &                  source;
+    memory_budget &             budget;
+    std::array<slot_t, n_slots> slots;
+    std::mutex                  mtx;
+    std::condition_variable     cv;
+    size_t                      n_published = 0; // number of slots handed over
+    bool                        done        = false;
+    std::atomic<bool>           stop        = false;
+    std::atomic<bool>           starving    = false; // the consumer waits for records
+    std::exception_ptr          exception;
+    std::thread                 thread; // started last
+
+    void produce()
+    {
+        size_t filling = n_slots; // the slot that is being filled, if any
+        try
+        {
+            auto it  = std::ranges::begin(source);
+            auto end = std::ranges::end(source);
+
+            for (size_t p = 0;; p = (p + 1) % n_slots)
+            {
+                slot_t & slot = slots[p];
+                {
+                    std::unique_lock lock{mtx};
+                    cv.wait(lock, [&] { return stop || !slot.full; });
+                    if (stop)
+                        return;
+                }
+
+                budget.wait_for_room([&] { return stop.load() || starving.load(); });
+                if (stop)
+                    return;
+
+                filling    = p;
+                slot.size  = 0;
+                slot.bytes = 0;
+                for (; it != end && slot.size < batch_size; ++it)
+                {
+                    std::swap(slot.records[slot.size], *it);
+                    slot.record_bytes[slot.size] = record_bytes(slot.records[slot.size]);
+                    slot.bytes += slot.record_bytes[slot.size++];
+                }
+                budget.add(slot.bytes);
+                filling = n_slots;
+
+                bool const last = it == end;
+                {
+                    std::lock_guard lock{mtx};
+                    slot.full = true;
+                    ++n_published;
+                    done = last;
+                }
+                cv.notify_all();
+
+                if (last)
+                    return;
+            }
+        }
+        catch (...)
+        {
+            /* the records decoded before the error are handed over first */
+            if (filling < n_slots)
+                budget.add(slots[filling].bytes);
+            {
+                std::lock_guard lock{mtx};
+                if (filling < n_slots && slots[filling].size > 0)
+                {
+                    slots[filling].full = true;
+                    ++n_published;
+                }
+                exception = std::current_exception();
+                done      = true;
+            }
+            cv.notify_all();
+        }
+    }
+
+public:
+    read_ahead(source_t & source, memory_budget & budget) :
+      source{source}, budget{budget}, thread{[this] { produce(); }}
+    {}
+
+    read_ahead(read_ahead const &)             = delete;
+    read_ahead & operator=(read_ahead const &) = delete;
+
+    ~read_ahead()
+    {
+        {
+            std::lock_guard lock{mtx};
+            stop = true;
+        }
+        cv.notify_all();
+        budget.interrupt();
+        thread.join();
+    }
+
+    /* the records of source in order; every record stays valid until the next one is requested */
+    decovar::stage_generator<record_t &> records()
+    {
+        for (size_t n_consumed = 0;; ++n_consumed)
+        {
+            slot_t & slot = slots[n_consumed % n_slots];
+            {
+                std::unique_lock lock{mtx};
+                if (n_consumed == n_published && !done)
+                {
+                    starving = true;
+                    budget.interrupt();
+                    cv.wait(lock, [&] { return n_consumed < n_published || done; });
+                    starving = false;
+                }
+                if (n_consumed == n_published) // done
+                {
+                    if (exception)
+                        std::rethrow_exception(exception);
+                    co_return;
+                }
+            }
+
+            /* the bytes of a record are accounted by whoever takes it over */
+            for (size_t i = 0; i < slot.size; ++i)
+            {
+                budget.release(slot.record_bytes[i]);
+                co_yield slot.records[i];
+            }
+
+            {
+                std::lock_guard lock{mtx};
+                slot.full = false;
+            }
+            cv.notify_all();
+        }
+    }
+};
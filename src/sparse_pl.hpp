@@ -0,0 +1,99 @@
+// MIT License
+//
+// Copyright (c) 2023 deCODE Genetics
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+#include <cassert>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <vector>
+
+#include <bio/ranges/container/concatenated_sequences.hpp>
+
+#include "misc.hpp"
+
+/* Genotype likelihoods of all samples where only the values below a cap are stored; all other values are implied
+ * to be equal to the cap. For records with many alleles, almost all of the G = (n_alts+1)(n_alts+2)/2 values per
+ * sample are capped, so kernels that iterate over the stored values instead of all genotypes are much faster and
+ * need no G-sized scratch space. */
+class sparse_PLs
+{
+public:
+    struct entry_t
+    {
+        uint16_t a;     // first allele of the genotype (a <= b)
+        uint16_t b;     // second allele of the genotype
+        int32_t  value; // reserved values (missing, …) are stored as their int32_t counterparts
+    };
+
+private:
+    std::vector<entry_t> entries;
+    std::vector<size_t>  offsets{0}; // per sample
+    int32_t              cap_ = std::numeric_limits<int32_t>::max();
+
+public:
+    /* number of samples */
+    size_t size() const noexcept { return offsets.size() - 1; }
+
+    int32_t cap() const noexcept { return cap_; }
+
+    /* the stored values of sample j, in VCF genotype order */
+    std::span<entry_t const> operator[](size_t const j) const
+    {
+        return std::span<entry_t const>{entries}.subspan(offsets[j], offsets[j + 1] - offsets[j]);
+    }
+
+    /* keeps the values of dense that are smaller than cap */
+    template <std::signed_integral int_t>
+    void assign(bio::ranges::concatenated_sequences<std::vector<int_t>> const & dense,
+                size_t const                                                    n_alts,
+                int32_t const                                                   cap)
+    {
+        assert(n_alts < std::numeric_limits<uint16_t>::max());
+
+        entries.clear();
+        offsets.assign(1, 0);
+        cap_ = cap;
+
+        for (std::span<int_t const> const sample_PLs : dense)
+        {
+            size_t k = 0;
+            for (size_t b = 0; b <= n_alts && k < sample_PLs.size(); ++b)
+            {
+                for (size_t a = 0; a <= b && k < sample_PLs.size(); ++a, ++k)
+                {
+                    int32_t const value = convert_int_value<int32_t>(sample_PLs[k]);
+                    if (value < cap)
+                        entries.push_back({static_cast<uint16_t>(a), static_cast<uint16_t>(b), value});
+                }
+            }
+            offsets.push_back(entries.size());
+        }
+    }
+};
+
+/* records with fewer genotypes are processed densely */
+inline constexpr size_t sparse_PL_min_genotypes = 1024; // n_alts >= 44
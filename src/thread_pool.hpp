@@ -0,0 +1,178 @@
+// MIT License
+//
+// Copyright (c) 2023 deCODE Genetics
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace decovar
+{
+
+/* A minimal pool of worker threads that execute index-parallel loops. The calling thread participates in the work,
+ * so a pool with zero workers simply runs everything on the calling thread. Several threads may run loops at the same
+ * time (e.g. when processing several files); the workers help with the loops in the order they were started. */
+class thread_pool
+{
+private:
+    struct job_t
+    {
+        std::function<void(size_t)> fn;
+        size_t                      size       = 0;
+        std::atomic<size_t>         next_index = 0;
+        size_t                      n_finished = 0;
+        size_t                      n_active   = 0; // workers that may still touch the job
+        std::exception_ptr          first_exception;
+    };
+
+    std::vector<std::thread> workers;
+
+    std::mutex              mtx;
+    std::condition_variable job_cv;
+    std::condition_variable done_cv;
+
+    std::deque<job_t *> jobs; // jobs with indexes left
+    bool                stop = false;
+
+    /* processes indexes of the job until none are left; returns the number of indexes processed */
+    size_t work(job_t & job)
+    {
+        size_t processed = 0;
+        for (size_t i = job.next_index++; i < job.size; i = job.next_index++)
+        {
+            try
+            {
+                job.fn(i);
+            }
+            catch (...)
+            {
+                std::lock_guard lock{mtx};
+                if (!job.first_exception)
+                    job.first_exception = std::current_exception();
+            }
+            ++processed;
+        }
+        return processed;
+    }
+
+    /* no more indexes of the job are handed out; expects mtx to be locked */
+    void retire(job_t & job)
+    {
+        if (auto it = std::ranges::find(jobs, &job); it != jobs.end())
+            jobs.erase(it);
+    }
+
+    void worker_loop()
+    {
+        while (true)
+        {
+            job_t * job = nullptr;
+            {
+                std::unique_lock lock{mtx};
+                job_cv.wait(lock, [&] { return stop || !jobs.empty(); });
+                if (stop)
+                    return;
+                job = jobs.front();
+                ++job->n_active;
+            }
+
+            size_t const processed = work(*job);
+
+            {
+                std::lock_guard lock{mtx};
+                retire(*job);
+                job->n_finished += processed;
+                --job->n_active;
+            }
+            done_cv.notify_all();
+        }
+    }
+
+public:
+    explicit thread_pool(size_t const n_workers)
+    {
+        workers.reserve(n_workers);
+        for (size_t i = 0; i < n_workers; ++i)
+            workers.emplace_back([this] { worker_loop(); });
+    }
+
+    thread_pool(thread_pool const &)             = delete;
+    thread_pool & operator=(thread_pool const &) = delete;
+
+    ~thread_pool()
+    {
+        {
+            std::lock_guard lock{mtx};
+            stop = true;
+        }
+        job_cv.notify_all();
+        for (std::thread & t : workers)
+            t.join();
+    }
+
+    size_t size() const noexcept { return workers.size(); }
+
+    /* calls fn(i) for every i in [0, n) and returns when all calls have finished; rethrows the first exception */
+    template <typename fn_t>
+    void parallel_for(size_t const n, fn_t && fn)
+    {
+        if (n == 0)
+            return;
+
+        if (workers.empty() || n == 1)
+        {
+            for (size_t i = 0; i < n; ++i)
+                fn(i);
+            return;
+        }
+
+        job_t job;
+        job.fn   = std::ref(fn);
+        job.size = n;
+        {
+            std::lock_guard lock{mtx};
+            jobs.push_back(&job);
+        }
+        job_cv.notify_all();
+
+        size_t const processed = work(job);
+
+        std::unique_lock lock{mtx};
+        retire(job);
+        job.n_finished += processed;
+        done_cv.wait(lock, [&] { return job.n_finished == job.size && job.n_active == 0; });
+
+        if (job.first_exception)
+            std::rethrow_exception(job.first_exception);
+    }
+};
+
+} // namespace decovar
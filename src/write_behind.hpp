@@ -0,0 +1,189 @@
+// MIT License
+//
+// Copyright (c) 2023 deCODE Genetics
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "memory_budget.hpp"
+#include "misc.hpp"
+
+/* Consumes records on a separate thread, so that encoding them (writer.push_back) overlaps with reading and
+ * transforming the following records. Records are handed over in batches that are swapped in; the caller gets
+ * already consumed records back in exchange, so it can salvage their buffers. Every record carries a tag_t that
+ * is passed to the consumer and returned with the record. Without a thread, records are consumed by push(). */
+template <typename tag_t, typename consume_fn_t>
+class write_behind
+{
+private:
+    static constexpr size_t n_slots = 2;
+
+    struct slot_t
+    {
+        std::vector<record_t> records;
+        std::vector<tag_t>    tags;
+        size_t                size  = 0;
+        size_t                bytes = 0; // accounted in the memory budget
+        bool                  full  = false;
+    };
+
+    consume_fn_t                consume;
+    memory_budget &             budget;
+    std::array<slot_t, n_slots> slots;
+    size_t                      n_pushed = 0;
+    std::mutex                  mtx;
+    std::condition_variable     cv;
+    bool                        stop = false;
+    std::exception_ptr          exception;
+    std::thread                 thread; // started last
+
+    void consume_slots()
+    {
+        for (size_t c = 0;; c = (c + 1) % n_slots)
+        {
+            slot_t & slot = slots[c];
+            {
+                std::unique_lock lock{mtx};
+                cv.wait(lock, [&] { return stop || slot.full; });
+                if (!slot.full) // stopped and nothing left
+                    return;
+            }
+
+            try
+            {
+                for (size_t i = 0; i < slot.size; ++i)
+                    consume(slot.records[i], slot.tags[i]);
+            }
+            catch (...)
+            {
+                {
+                    std::lock_guard lock{mtx};
+                    exception = std::current_exception();
+                }
+                cv.notify_all();
+                return;
+            }
+
+            {
+                std::lock_guard lock{mtx};
+                slot.full = false;
+            }
+            cv.notify_all();
+            budget.release(slot.bytes);
+        }
+    }
+
+    void rethrow()
+    {
+        if (exception)
+            std::rethrow_exception(std::exchange(exception, nullptr));
+    }
+
+public:
+    write_behind(consume_fn_t consume, memory_budget & budget, bool const threaded) :
+      consume{std::move(consume)}, budget{budget}
+    {
+        if (threaded)
+            thread = std::thread{[this] { consume_slots(); }};
+    }
+
+    write_behind(write_behind const &)             = delete;
+    write_behind & operator=(write_behind const &) = delete;
+
+    ~write_behind()
+    {
+        if (thread.joinable())
+        {
+            {
+                std::lock_guard lock{mtx};
+                stop = true;
+            }
+            cv.notify_all();
+            thread.join();
+        }
+    }
+
+    /* Hands over the records; afterwards they (and tags) contain consumed records or empty ones. The records' bytes
+     * are released from the memory budget once they are consumed. */
+    void push(std::span<record_t> const records, std::span<tag_t> const tags, size_t const bytes)
+    {
+        assert(records.size() == tags.size());
+
+        if (!thread.joinable())
+        {
+            for (size_t i = 0; i < records.size(); ++i)
+                consume(records[i], tags[i]);
+            budget.release(bytes);
+            return;
+        }
+
+        slot_t & slot = slots[n_pushed++ % n_slots];
+        {
+            std::unique_lock lock{mtx};
+            cv.wait(lock, [&] { return !slot.full || exception; });
+            rethrow();
+        }
+
+        slot.records.resize(std::max(slot.records.size(), records.size()));
+        slot.tags.resize(std::max(slot.tags.size(), tags.size()));
+        for (size_t i = 0; i < records.size(); ++i)
+        {
+            std::swap(slot.records[i], records[i]);
+            std::swap(slot.tags[i], tags[i]);
+        }
+        slot.size  = records.size();
+        slot.bytes = bytes;
+
+        {
+            std::lock_guard lock{mtx};
+            slot.full = true;
+        }
+        cv.notify_all();
+    }
+
+    /* waits until all records are consumed and stops the thread */
+    void finish()
+    {
+        if (!thread.joinable())
+            return;
+
+        {
+            std::lock_guard lock{mtx};
+            stop = true;
+        }
+        cv.notify_all();
+        thread.join();
+
+        rethrow();
+    }
+};